@@ -25,6 +25,7 @@
 #include <math.h>
 #include <samplerate.h>
 #include <stdalign.h>
+#include <stdatomic.h>
 #include <string.h>
 
 #include "lg_common/array.h"
@@ -34,6 +35,8 @@
 
 #include "audio.h"
 #include "audiodev.h"
+#include "audiotap.h"
+#include "metrics.h"
 
 static struct audio_opts audio_opts = (struct audio_opts) {
     .period_size = 256, // samples
@@ -41,6 +44,7 @@ static struct audio_opts audio_opts = (struct audio_opts) {
 
     .sink = NULL,
     .source = NULL,
+    .tap = NULL,
 
     .latency_cb = NULL,
 };
@@ -68,6 +72,7 @@ typedef struct {
 typedef struct {
     float *framesIn;
     float *framesOut;
+    float *framesXfade;
     int framesOutSize;
 
     int periodFrames;
@@ -88,7 +93,35 @@ typedef struct {
 
     double ratioIntegral;
 
+    int64_t startTime;
+    double pacingPeakSec;
+    int pacingPackets;
+    int lastUnderruns;
+    int boostFrames;
+
+    int64_t tapLatencyNs;
+
+    double load;
+    int64_t tierChangeTime;
+    int64_t tierUnderrunTime;
+    int tierUnderruns;
+
+    // Late packets queued in framesIn to be processed together
+    int burstPackets;
+    int burstExpected;
+    int64_t burstTime;
+
     SRC_STATE *src;
+    SRC_STATE *srcOld;
+    int xfadePos;
+    int xfadeFrames;
+    // Frames from the new resampler waiting at the start of framesOut
+    int xfadeHeld;
+    // Frames from the old resampler waiting at the start of framesXfade
+    int xfadeOld;
+
+    // Set when the device moved to another sink, until the offset is re-measured
+    bool devReseed;
 } PlaybackSpiceData;
 
 typedef struct {
@@ -110,6 +143,26 @@ typedef struct {
 
         RingBuffer timings;
 
+        // Index into playbackTiers, kept across streams
+        int tier;
+
+        /* Incremented by the device thread whenever it has to read past the end
+         * of the buffer while running. */
+        atomic_int underruns;
+
+        /* Set by the audio device when the stream has been moved to another
+         * sink, so the device thread re-seeds its clock measurement. */
+        atomic_bool deviceChanged;
+
+        /* Spice packet pacing statistics, kept across streams so the startup
+         * pre-buffer can be sized for this host rather than for the worst
+         * case. */
+        struct {
+            int streams;
+            double jitterSec;
+            double boostSec;
+        } pacing;
+
         /* These two structs contain data specifically for use in the device and
          * Spice data threads respectively. Keep them on separate cache lines to
          * avoid false sharing. */
@@ -131,29 +184,94 @@ typedef struct {
     } record;
 } AudioState;
 
-static AudioState audio = {0};
+static AudioState audio = {
+    .playback.tier = 1,
+};
+
+/* Resampler quality tiers, from best to cheapest. Playback starts at the
+ * current tier and moves between them depending on how much of each period
+ * resampling takes in wall-clock time, and whether the device is underrunning.
+ * The relative cost is roughly what libsamplerate's converters cost compared to
+ * each other, and is used to predict the load before stepping up. */
+static const struct {
+    int converter;
+    const char *name;
+    double relativeCost;
+} playbackTiers[] = {
+    {SRC_SINC_MEDIUM_QUALITY, "sinc medium", 3.0},
+    {SRC_SINC_FASTEST, "sinc fastest", 1.0},
+    {SRC_LINEAR, "linear", 0.1},
+};
+
+/* Resampling normally takes well under 1% of a period even at the highest tier,
+ * so taking a quarter of it means we are being starved of CPU. Only step up if
+ * the next tier is predicted to stay far away from that. */
+#define PLAYBACK_TIER_OVERLOAD 0.25
+#define PLAYBACK_TIER_HEADROOM 0.05
 
 typedef struct {
     int periodFrames;
     int64_t nextTime;
     int64_t nextPosition;
+    bool reseed;
 } PlaybackDeviceTick;
 
+/* Underruns within this long of the device starting are treated as a sign that
+ * the startup pre-buffer was too small. */
+#define PLAYBACK_EARLY_UNDERRUN_NS 2000000000LL
+
+// Maximum number of Spice packets to process in a single pass after a stall
+#define PLAYBACK_MAX_BURST 8
+
+static void playback_update_pacing(void) {
+    PlaybackSpiceData *spiceData = &audio.playback.spiceData;
+
+    /* Keep a slowly decaying peak of the packet arrival jitter. Short streams
+     * don't tell us much about the pacing, so ignore them. */
+    if (spiceData->pacingPackets >= 50) {
+        double jitterSec = spiceData->pacingPeakSec;
+        if (audio.playback.pacing.streams > 0)
+            jitterSec = max(jitterSec,
+                            0.75 * audio.playback.pacing.jitterSec + 0.25 * jitterSec);
+        audio.playback.pacing.jitterSec = jitterSec;
+        audio.playback.pacing.streams++;
+    }
+
+    /* If we had to grow the buffer after starting, start with that much more
+     * next time, otherwise slowly give it back. */
+    if (spiceData->boostFrames > 0)
+        audio.playback.pacing.boostSec +=
+            (double)spiceData->boostFrames / audio.playback.sampleRate;
+    else
+        audio.playback.pacing.boostSec *= 0.5;
+    audio.playback.pacing.boostSec =
+        min(audio.playback.pacing.boostSec,
+            spiceData->periodFrames * 2.0 / audio.playback.sampleRate);
+
+    spiceData->pacingPeakSec = 0.0;
+    spiceData->pacingPackets = 0;
+    spiceData->boostFrames = 0;
+}
+
 static void playback_stop(void) {
     if (audio.playback.state == STREAM_STATE_STOP)
         return;
 
     audio.playback.state = STREAM_STATE_STOP;
     audiodev_playback_stop();
+    audiotap_format(0, 0);
     ringbuffer_free(&audio.playback.buffer);
     ringbuffer_free(&audio.playback.deviceTiming);
     audio.playback.spiceData.src = src_delete(audio.playback.spiceData.src);
+    audio.playback.spiceData.srcOld = src_delete(audio.playback.spiceData.srcOld);
 
     if (audio.playback.spiceData.framesIn) {
         free(audio.playback.spiceData.framesIn);
         free(audio.playback.spiceData.framesOut);
+        free(audio.playback.spiceData.framesXfade);
         audio.playback.spiceData.framesIn = NULL;
         audio.playback.spiceData.framesOut = NULL;
+        audio.playback.spiceData.framesXfade = NULL;
     }
 
     if (audio.playback.timings) {
@@ -173,7 +291,8 @@ void audio_playback_start(int channels, int sampleRate, PSAudioFormat format,
         playback_stop();
 
     int srcError;
-    audio.playback.spiceData.src = src_new(SRC_SINC_FASTEST, channels, &srcError);
+    audio.playback.spiceData.src =
+        src_new(playbackTiers[audio.playback.tier].converter, channels, &srcError);
     if (!audio.playback.spiceData.src) {
         DEBUG_ERROR("Failed to create resampler: %s", src_strerror(srcError));
         return;
@@ -204,13 +323,36 @@ void audio_playback_start(int channels, int sampleRate, PSAudioFormat format,
     audio.playback.spiceData.offsetError = 0.0;
     audio.playback.spiceData.offsetErrorIntegral = 0.0;
     audio.playback.spiceData.ratioIntegral = 0.0;
+    audio.playback.spiceData.startTime = INT64_MIN;
+    audio.playback.spiceData.pacingPeakSec = 0.0;
+    audio.playback.spiceData.pacingPackets = 0;
+    audio.playback.spiceData.lastUnderruns = atomic_load(&audio.playback.underruns);
+    audio.playback.spiceData.boostFrames = 0;
+    audio.playback.spiceData.tapLatencyNs = 0;
+    audio.playback.spiceData.load = 0.0;
+    /* There is no load measurement yet, so don't step up until this stream has
+     * been running quietly for a while. */
+    audio.playback.spiceData.tierChangeTime = nanotime();
+    audio.playback.spiceData.tierUnderrunTime = INT64_MIN;
+    audio.playback.spiceData.tierUnderruns = 0;
+    audio.playback.spiceData.burstPackets = 0;
+    audio.playback.spiceData.xfadeHeld = 0;
+    audio.playback.spiceData.xfadeOld = 0;
+    audio.playback.spiceData.devReseed = false;
+    atomic_store(&audio.playback.deviceChanged, false);
+
+    audiotap_format(channels, sampleRate);
 
     int requestedPeriodFrames = max(audio_opts.period_size, 1);
     audio.playback.deviceMaxPeriodFrames = 0;
     audio.playback.deviceStartFrames = 0;
-    audiodev_playback_setup(audio_opts.sink, channels, sampleRate, requestedPeriodFrames,
-                            &audio.playback.deviceMaxPeriodFrames,
-                            &audio.playback.deviceStartFrames);
+    if (!audiodev_playback_setup(audio_opts.sink, channels, sampleRate, requestedPeriodFrames,
+                                 &audio.playback.deviceMaxPeriodFrames,
+                                 &audio.playback.deviceStartFrames)) {
+        DEBUG_ERROR("Failed to set up the playback stream");
+        playback_stop();
+        return;
+    }
     DEBUG_ASSERT(audio.playback.deviceMaxPeriodFrames > 0);
 
     // if a volume level was stored, set it before we return
@@ -225,14 +367,36 @@ void audio_playback_start(int channels, int sampleRate, PSAudioFormat format,
     audio.playback.timings = ringbuffer_new(1200, sizeof(float));
 }
 
+/* Ends a resampler crossfade early, writing out any frames it was still
+ * holding back. */
+static void playback_end_crossfade(void) {
+    PlaybackSpiceData *spiceData = &audio.playback.spiceData;
+    if (spiceData->xfadeHeld) {
+        ringbuffer_append(audio.playback.buffer, spiceData->framesOut,
+                          spiceData->xfadeHeld);
+        audiotap_write(spiceData->framesOut, spiceData->xfadeHeld,
+                       spiceData->tapLatencyNs);
+        spiceData->nextPosition += spiceData->xfadeHeld;
+        spiceData->xfadeHeld = 0;
+    }
+    spiceData->xfadeOld = 0;
+    spiceData->srcOld = src_delete(spiceData->srcOld);
+}
+
 void audio_playback_stop(void) {
     switch (audio.playback.state) {
     case STREAM_STATE_RUN: {
+        audio_playback_flush();
+
         // Keep the audio device open for a while to reduce startup latency if
         // playback starts again
         audio.playback.state = STREAM_STATE_KEEP_ALIVE;
 
+        playback_update_pacing();
+        metrics_audio_playing(false);
+
         // Reset the resampler so it is safe to use for the next playback
+        playback_end_crossfade();
         int error = src_reset(audio.playback.spiceData.src);
         if (error) {
             DEBUG_ERROR("Failed to reset resampler: %s", src_strerror(error));
@@ -360,6 +524,9 @@ bool audio_init(const struct audio_opts *opts) {
     if (opts) {
         audio_opts = *opts;
     }
+    if (audio_opts.tap && !audiotap_open(audio_opts.tap)) {
+        DEBUG_WARN("Failed to open the playback tap; continuing without it");
+    }
     return audiodev_init();
 }
 
@@ -368,6 +535,7 @@ void audio_free(void) {
     playback_stop();
     audio_record_stop();
     audiodev_free();
+    audiotap_close();
 }
 
 int audio_pull(uint8_t *dst, int frames) {
@@ -393,6 +561,23 @@ int audio_pull(uint8_t *dst, int frames) {
             audio.playback.state = STREAM_STATE_RUN;
         }
 
+        /* If we were moved to another sink, the device clock and quantum have
+         * changed, and there was probably a gap while the stream was relinked.
+         * Rather than letting the DLL treat that as a huge error (and slew the
+         * buffer), restart the device clock measurement from here. The buffer
+         * itself is left alone so playback stays continuous, and the Spice
+         * thread's controller absorbs any change in the offset. */
+        bool reseed = false;
+        if (atomic_exchange(&audio.playback.deviceChanged, false) &&
+            audio.playback.state == STREAM_STATE_RUN && data->periodFrames != 0) {
+            data->periodFrames = 0;
+            reseed = true;
+        }
+
+        if (audio.playback.state == STREAM_STATE_RUN &&
+            ringbuffer_getCount(audio.playback.buffer) < frames)
+            atomic_fetch_add(&audio.playback.underruns, 1);
+
         // Measure the device clock and post to the Spice thread
         if (frames != data->periodFrames) {
             double newPeriodSec = (double)frames / audio.playback.sampleRate;
@@ -440,7 +625,8 @@ int audio_pull(uint8_t *dst, int frames) {
 
         PlaybackDeviceTick tick = {.periodFrames = data->periodFrames,
                                    .nextTime = data->nextTime,
-                                   .nextPosition = data->nextPosition};
+                                   .nextPosition = data->nextPosition,
+                                   .reseed = reseed};
         ringbuffer_push(audio.playback.deviceTiming, &tick);
 
         ringbuffer_consume(audio.playback.buffer, dst, frames);
@@ -458,57 +644,156 @@ int audio_pull(uint8_t *dst, int frames) {
     return frames;
 }
 
-static double compute_device_position(int64_t curTime) {
-    // Interpolate to calculate the current device position
+static void playback_set_tier(int64_t now, int tier) {
     PlaybackSpiceData *spiceData = &audio.playback.spiceData;
-    return spiceData->devLastPosition +
-           (spiceData->devNextPosition - spiceData->devLastPosition) *
-               ((double)(curTime - spiceData->devLastTime) /
-                (spiceData->devNextTime - spiceData->devLastTime));
-}
 
-void audio_playback_data(uint8_t *data, size_t size) {
-    if (audio.playback.state == STREAM_STATE_STOP || size == 0)
+    int srcError;
+    SRC_STATE *src =
+        src_new(playbackTiers[tier].converter, audio.playback.channels, &srcError);
+    if (!src) {
+        DEBUG_ERROR("Failed to create resampler: %s", src_strerror(srcError));
         return;
+    }
 
+    DEBUG_INFO("Switching resampler from %s to %s (load %.1f%%, %d underruns)",
+               playbackTiers[audio.playback.tier].name, playbackTiers[tier].name,
+               spiceData->load * 100.0, spiceData->tierUnderruns);
+
+    /* Keep running the old resampler for a few milliseconds and crossfade to
+     * the new one so the switch doesn't click. The tier is never changed while
+     * a crossfade is still running. */
+    spiceData->srcOld = spiceData->src;
+    spiceData->src = src;
+    spiceData->xfadePos = 0;
+    spiceData->xfadeFrames = audio.playback.sampleRate / 100;
+
+    audio.playback.tier = tier;
+    spiceData->tierChangeTime = now;
+    spiceData->tierUnderruns = 0;
+}
+
+static void playback_update_tier(int64_t now) {
     PlaybackSpiceData *spiceData = &audio.playback.spiceData;
-    int64_t now = nanotime();
+    if (spiceData->srcOld)
+        return;
 
-    // Convert from s16 to f32 samples
-    int spiceStride = audio.playback.channels * sizeof(int16_t);
-    int frames = size / spiceStride;
-    bool periodChanged = frames != spiceData->periodFrames;
-    bool init = spiceData->periodFrames == 0;
+    int64_t sinceChange = spiceData->tierChangeTime == INT64_MIN
+                              ? INT64_MAX
+                              : now - spiceData->tierChangeTime;
+    int64_t sinceUnderrun = spiceData->tierUnderrunTime == INT64_MIN
+                                ? INT64_MAX
+                                : now - spiceData->tierUnderrunTime;
+
+    /* Step down if resampling is taking a large part of the period, or if the
+     * device keeps underrunning. The load is wall-clock time, so it also goes
+     * up when we are preempted by other work on the host. Give the previous
+     * change a couple of seconds to take effect first. */
+    bool overloaded = spiceData->load > PLAYBACK_TIER_OVERLOAD ||
+                      spiceData->tierUnderruns >= 2;
+    if (overloaded && audio.playback.tier < (int)ARRAY_LENGTH(playbackTiers) - 1 &&
+        sinceChange > 2000000000LL) {
+        playback_set_tier(now, audio.playback.tier + 1);
+        return;
+    }
 
-    if (periodChanged) {
-        if (spiceData->framesIn) {
-            free(spiceData->framesIn);
-            free(spiceData->framesOut);
-        }
-        spiceData->periodFrames = frames;
-        spiceData->framesIn = malloc(frames * audio.playback.stride);
-        if (!spiceData->framesIn) {
-            DEBUG_ERROR("Failed to malloc framesIn");
-            playback_stop();
-            return;
-        }
+    /* Only step back up once things have been quiet for a while, and if the
+     * next tier up is expected to leave plenty of headroom. */
+    if (audio.playback.tier > 0 &&
+        sinceChange > 30000000000LL && sinceUnderrun > 30000000000LL) {
+        double predicted = spiceData->load *
+                           playbackTiers[audio.playback.tier - 1].relativeCost /
+                           playbackTiers[audio.playback.tier].relativeCost;
+        if (predicted < PLAYBACK_TIER_HEADROOM)
+            playback_set_tier(now, audio.playback.tier - 1);
+    }
+}
 
-        spiceData->framesOutSize = round(frames * 1.1);
-        spiceData->framesOut =
-            malloc(spiceData->framesOutSize * audio.playback.stride);
-        if (!spiceData->framesOut) {
-            DEBUG_ERROR("Failed to malloc framesOut");
-            playback_stop();
-            return;
+/* Mixes the old resampler's output into the new one's in framesOut, and
+ * returns how many frames at the start of framesOut are ready to be written. */
+static int playback_crossfade(SRC_DATA *srcData) {
+    PlaybackSpiceData *spiceData = &audio.playback.spiceData;
+    int channels = audio.playback.channels;
+
+    /* Feed the old resampler exactly the same input as the new one. The two
+     * converters have different delays, so their output doesn't line up from
+     * one call to the next. Whichever side is ahead is held back until the
+     * other catches up, so that the fade always runs over its full length. */
+    SRC_DATA oldData = {.data_in = srcData->data_in,
+                        .data_out = spiceData->framesXfade +
+                                    spiceData->xfadeOld * channels,
+                        .input_frames = srcData->input_frames_used,
+                        .output_frames = spiceData->framesOutSize,
+                        .input_frames_used = 0,
+                        .output_frames_gen = 0,
+                        .end_of_input = 0,
+                        .src_ratio = srcData->src_ratio};
+
+    int newFrames = spiceData->xfadeHeld + srcData->output_frames_gen;
+    int error = src_process(spiceData->srcOld, &oldData);
+    if (error) {
+        DEBUG_ERROR("Resampling failed: %s", src_strerror(error));
+        spiceData->xfadeHeld = 0;
+        spiceData->xfadeOld = 0;
+        spiceData->srcOld = src_delete(spiceData->srcOld);
+        return newFrames;
+    }
+    int oldFrames = spiceData->xfadeOld + oldData.output_frames_gen;
+
+    int n = 0;
+    while (n < newFrames && n < oldFrames &&
+           spiceData->xfadePos < spiceData->xfadeFrames) {
+        float gain = (float)spiceData->xfadePos / spiceData->xfadeFrames;
+        for (int ch = 0; ch < channels; ++ch) {
+            float *out = &spiceData->framesOut[n * channels + ch];
+            *out = *out * gain + spiceData->framesXfade[n * channels + ch] * (1.0f - gain);
         }
+        ++n;
+        ++spiceData->xfadePos;
+    }
+
+    /* Once the fade is complete, anything left from the new resampler can go
+     * out as is. The held back side is bounded by the difference in delay
+     * between the converters, so if it ever grows past a period something has
+     * gone badly wrong and we just cut over. */
+    if (spiceData->xfadePos >= spiceData->xfadeFrames ||
+        newFrames - n > spiceData->framesOutSize ||
+        oldFrames - n > spiceData->framesOutSize) {
+        spiceData->xfadeHeld = 0;
+        spiceData->xfadeOld = 0;
+        spiceData->srcOld = src_delete(spiceData->srcOld);
+        return newFrames;
     }
 
-    src_short_to_float_array((int16_t *)data, spiceData->framesIn,
-                             frames * audio.playback.channels);
+    memmove(spiceData->framesXfade, spiceData->framesXfade + n * channels,
+            (oldFrames - n) * audio.playback.stride);
+    spiceData->xfadeOld = oldFrames - n;
+    spiceData->xfadeHeld = newFrames - n;
+    return n;
+}
+
+static double compute_device_position(int64_t curTime) {
+    // Interpolate to calculate the current device position
+    PlaybackSpiceData *spiceData = &audio.playback.spiceData;
+    return spiceData->devLastPosition +
+           (spiceData->devNextPosition - spiceData->devLastPosition) *
+               ((double)(curTime - spiceData->devLastTime) /
+                (spiceData->devNextTime - spiceData->devLastTime));
+}
+
+/* Processes `frames` frames of audio from framesIn, made up of `packets` Spice
+ * packets, the first of which arrived at `now`. */
+static void playback_process(int64_t now, int frames, int packets,
+                             bool periodChanged, bool init) {
+    PlaybackSpiceData *spiceData = &audio.playback.spiceData;
 
     // Receive timing information from the audio device thread
     PlaybackDeviceTick deviceTick;
     while (ringbuffer_consume(audio.playback.deviceTiming, &deviceTick, 1)) {
+        // Don't interpolate across a sink change
+        if (deviceTick.reseed) {
+            spiceData->devNextTime = INT64_MIN;
+            spiceData->devReseed = true;
+        }
         spiceData->devPeriodFrames = deviceTick.periodFrames;
         spiceData->devLastTime = spiceData->devNextTime;
         spiceData->devLastPosition = spiceData->devNextPosition;
@@ -516,6 +801,33 @@ void audio_playback_data(uint8_t *data, size_t size) {
         spiceData->devNextPosition = deviceTick.nextPosition;
     }
 
+    /* If the device underran shortly after starting, the startup pre-buffer was
+     * too small for the current packet pacing. Skip ahead to grow the buffer by
+     * half a Spice period at a time, up to the conservative startup size. */
+    int underruns = atomic_load(&audio.playback.underruns);
+    if (underruns != spiceData->lastUnderruns) {
+        spiceData->lastUnderruns = underruns;
+        bool early = spiceData->startTime != INT64_MIN &&
+                     now - spiceData->startTime < PLAYBACK_EARLY_UNDERRUN_NS;
+
+        // Count underruns close together towards stepping the resampler down
+        if (audio.playback.state == STREAM_STATE_RUN && !early) {
+            if (spiceData->tierUnderrunTime == INT64_MIN ||
+                now - spiceData->tierUnderrunTime > 5000000000LL)
+                spiceData->tierUnderruns = 0;
+            spiceData->tierUnderruns++;
+            spiceData->tierUnderrunTime = now;
+        }
+
+        if (audio.playback.state == STREAM_STATE_RUN && early &&
+            spiceData->boostFrames < spiceData->periodFrames * 2) {
+            int boostFrames = max(spiceData->periodFrames / 2, 1);
+            ringbuffer_append(audio.playback.buffer, NULL, boostFrames);
+            spiceData->nextPosition += boostFrames;
+            spiceData->boostFrames += boostFrames;
+        }
+    }
+
     /* Determine the target latency. This is made up of the maximum audio device
      * period (or the current actual period, if larger than the expected
      * maximum), plus a little extra to absorb timing jitter, and a configurable
@@ -566,6 +878,9 @@ void audio_playback_data(uint8_t *data, size_t size) {
         targetLatencyFrames +=
             audio.playback.deviceMaxPeriodFrames - spiceData->devPeriodFrames;
 
+    // Keep any extra buffer we had to add after startup
+    targetLatencyFrames += spiceData->boostFrames;
+
     // Measure the Spice audio clock
     int64_t curTime;
     int64_t curPosition;
@@ -614,22 +929,32 @@ void audio_playback_data(uint8_t *data, size_t size) {
             curTime = now;
             curPosition = spiceData->nextPosition + slewFrames;
 
-            spiceData->periodSec = (double)frames / audio.playback.sampleRate;
-            spiceData->nextTime = now + llrint(spiceData->periodSec * 1.0e9);
+            spiceData->periodSec =
+                (double)spiceData->periodFrames / audio.playback.sampleRate;
+            spiceData->nextTime =
+                now + llrint(spiceData->periodSec * packets * 1.0e9);
             spiceData->nextPosition = curPosition;
 
             spiceData->offsetError = 0.0;
             spiceData->offsetErrorIntegral = 0.0;
             spiceData->ratioIntegral = 0.0;
 
+            if (audio.playback.state == STREAM_STATE_KEEP_ALIVE)
+                metrics_audio_playing(true);
             audio.playback.state = STREAM_STATE_RUN;
         } else {
             curTime = spiceData->nextTime;
             curPosition = spiceData->nextPosition;
 
+            /* For a burst, the error is measured from the first packet, and
+             * the prediction is advanced over the whole burst at once. */
             spiceData->nextTime +=
-                llrint((spiceData->b * error + spiceData->periodSec) * 1.0e9);
+                llrint((spiceData->b * error + spiceData->periodSec * packets) *
+                       1.0e9);
             spiceData->periodSec += spiceData->c * error;
+
+            spiceData->pacingPeakSec = max(spiceData->pacingPeakSec, fabs(error));
+            spiceData->pacingPackets++;
         }
     }
 
@@ -647,6 +972,16 @@ void audio_playback_data(uint8_t *data, size_t size) {
         actualOffset = curPosition - devPosition;
         double actualOffsetError = -(actualOffset - targetLatencyFrames);
 
+        /* First measurement after a sink change. The filter's rate of change
+         * was tracking the old sink, so drop it and let the filtered offset
+         * ramp towards the new one from where it is, rather than jumping.
+         * The controller's integral is kept since the clock drift between
+         * Spice and us hasn't changed. */
+        if (spiceData->devReseed) {
+            spiceData->offsetErrorIntegral = 0.0;
+            spiceData->devReseed = false;
+        }
+
         double error = actualOffsetError - offsetError;
         spiceData->offsetError +=
             spiceData->b * error + spiceData->offsetErrorIntegral;
@@ -658,16 +993,22 @@ void audio_playback_data(uint8_t *data, size_t size) {
     double kp = 0.5e-6;
     double ki = 1.0e-16;
 
-    spiceData->ratioIntegral += offsetError * spiceData->periodSec;
+    spiceData->ratioIntegral += offsetError * spiceData->periodSec * packets;
 
     double piOutput = kp * offsetError + ki * spiceData->ratioIntegral;
     double ratio = 1.0 + piOutput;
 
+    if (audio.playback.state == STREAM_STATE_RUN)
+        playback_update_tier(now);
+
+    int64_t resampleStart = nanotime();
+
     int consumed = 0;
     while (consumed < frames) {
         SRC_DATA srcData = {.data_in = spiceData->framesIn +
                                        consumed * audio.playback.channels,
-                            .data_out = spiceData->framesOut,
+                            .data_out = spiceData->framesOut +
+                                        spiceData->xfadeHeld * audio.playback.channels,
                             .input_frames = frames - consumed,
                             .output_frames = spiceData->framesOutSize,
                             .input_frames_used = 0,
@@ -681,22 +1022,55 @@ void audio_playback_data(uint8_t *data, size_t size) {
             return;
         }
 
-        ringbuffer_append(audio.playback.buffer, spiceData->framesOut,
-                          srcData.output_frames_gen);
+        int outFrames = srcData.output_frames_gen;
+        if (spiceData->srcOld)
+            outFrames = playback_crossfade(&srcData);
+
+        ringbuffer_append(audio.playback.buffer, spiceData->framesOut, outFrames);
+        audiotap_write(spiceData->framesOut, outFrames, spiceData->tapLatencyNs);
 
         consumed += srcData.input_frames_used;
-        spiceData->nextPosition += srcData.output_frames_gen;
+        spiceData->nextPosition += outFrames;
+
+        // Anything the crossfade held back goes out first next time
+        if (spiceData->xfadeHeld)
+            memmove(spiceData->framesOut,
+                    spiceData->framesOut + outFrames * audio.playback.channels,
+                    spiceData->xfadeHeld * audio.playback.stride);
+    }
+
+    /* Track the fraction of each period spent resampling, in wall-clock time
+     * so that time spent preempted counts too. Crossfades run two resamplers at
+     * once, so don't count those. */
+    if (!spiceData->srcOld) {
+        double sec = (nanotime() - resampleStart) * 1.0e-9;
+        double load = sec / ((double)frames / audio.playback.sampleRate);
+        spiceData->load += (load - spiceData->load) * 0.05;
     }
 
     if (audio.playback.state == STREAM_STATE_SETUP_SPICE) {
         /* Latency corrections at startup can be quite significant due to poor
-         * packet pacing from Spice, so require at least two full Spice periods'
-         * worth of data in addition to the startup delay requested by the
-         * device before starting playback to minimise the chances of
-         * underrunning. */
+         * packet pacing from Spice, so without any history require at least
+         * two full Spice periods' worth of data in addition to the startup
+         * delay requested by the device before starting playback to minimise
+         * the chances of underrunning.
+         *
+         * Once we have seen how well packets are actually paced on this host,
+         * only buffer enough to cover the observed jitter (plus anything we had
+         * to add after previous starts). If that turns out to be too little,
+         * the buffer is grown when the first underruns occur. */
         int startFrames =
             spiceData->periodFrames * 2 + audio.playback.deviceStartFrames;
+        if (audio.playback.pacing.streams > 0) {
+            int resamplerLatencyFrames = 20;
+            double marginSec = audio.playback.pacing.jitterSec * 2.0 +
+                               audio.playback.pacing.boostSec;
+            startFrames = min(startFrames,
+                              audio.playback.deviceStartFrames + resamplerLatencyFrames +
+                                  (int)ceil(marginSec * audio.playback.sampleRate));
+        }
         audio.playback.targetStartFrames = startFrames;
+        spiceData->startTime = now;
 
         /* The actual time between opening the device and the device starting to
          * pull data can range anywhere between nearly instant and hundreds of
@@ -708,6 +1082,7 @@ void audio_playback_data(uint8_t *data, size_t size) {
          * the adaptive resampling deal with it. */
         audio.playback.state = STREAM_STATE_SETUP_DEVICE;
         audiodev_playback_start();
+        metrics_audio_playing(true);
     }
 
     double latencyFrames = actualOffset;
@@ -715,6 +1090,11 @@ void audio_playback_data(uint8_t *data, size_t size) {
 
     const float latency = latencyFrames * 1000.0 / audio.playback.sampleRate;
     ringbuffer_push(audio.playback.timings, &latency);
+    spiceData->tapLatencyNs = llrint(latency * 1.0e6);
+
+    metrics_audio_playback(latency,
+        -spiceData->offsetError * 1000.0 / audio.playback.sampleRate,
+        ratio, spiceData->devPeriodFrames, underruns);
 
     if (audio_opts.latency_cb) {
         audio_opts.latency_cb(latency,
@@ -722,3 +1102,109 @@ void audio_playback_data(uint8_t *data, size_t size) {
             audiodev_playback_latency()*1000.0/audio.playback.sampleRate);
     }
 }
+
+void audio_playback_device_changed(void) {
+    if (audio.playback.state != STREAM_STATE_RUN)
+        return;
+
+    DEBUG_INFO("Playback moved to another sink, re-seeding device timing");
+    atomic_store(&audio.playback.deviceChanged, true);
+}
+
+void audio_playback_data(uint8_t *data, size_t size) {
+    if (audio.playback.state == STREAM_STATE_STOP || size == 0)
+        return;
+
+    PlaybackSpiceData *spiceData = &audio.playback.spiceData;
+    int64_t now = nanotime();
+
+    // Convert from s16 to f32 samples
+    int spiceStride = audio.playback.channels * sizeof(int16_t);
+    int frames = size / spiceStride;
+    bool periodChanged = frames != spiceData->periodFrames;
+    bool init = spiceData->periodFrames == 0;
+
+    if (periodChanged) {
+        if (spiceData->burstPackets)
+            audio_playback_flush();
+
+        if (spiceData->srcOld)
+            playback_end_crossfade();
+
+        if (spiceData->framesIn) {
+            free(spiceData->framesIn);
+            free(spiceData->framesOut);
+            free(spiceData->framesXfade);
+        }
+        spiceData->periodFrames = frames;
+        spiceData->framesIn =
+            malloc(frames * PLAYBACK_MAX_BURST * audio.playback.stride);
+        if (!spiceData->framesIn) {
+            DEBUG_ERROR("Failed to malloc framesIn");
+            playback_stop();
+            return;
+        }
+
+        /* framesOut and framesXfade have room for a second period so that a
+         * crossfade can hold frames back from one side (see
+         * playback_crossfade). */
+        spiceData->framesOutSize = round(frames * 1.1);
+        spiceData->framesOut =
+            malloc(spiceData->framesOutSize * 2 * audio.playback.stride);
+        if (!spiceData->framesOut) {
+            DEBUG_ERROR("Failed to malloc framesOut");
+            playback_stop();
+            return;
+        }
+
+        spiceData->framesXfade =
+            malloc(spiceData->framesOutSize * 2 * audio.playback.stride);
+        if (!spiceData->framesXfade) {
+            DEBUG_ERROR("Failed to malloc framesXfade");
+            playback_stop();
+            return;
+        }
+    }
+
+    src_short_to_float_array(
+        (int16_t *)data,
+        spiceData->framesIn + spiceData->burstPackets * frames * audio.playback.channels,
+        frames * audio.playback.channels);
+
+    /* If the main loop was held up, several packets will be waiting for us and
+     * will arrive back to back. Only the first of them says anything about the
+     * Spice clock, so rather than feeding each one through the clock and
+     * latency filters, queue them up and process them together. How late the
+     * first one is tells us how many were due in the meantime, so the burst is
+     * processed as soon as the last of those arrives. If fewer turn up, the
+     * main loop flushes what we have once it has handled everything pending
+     * (see audio_playback_flush). */
+    if (!periodChanged && audio.playback.state == STREAM_STATE_RUN) {
+        if (spiceData->burstPackets) {
+            if (++spiceData->burstPackets >= spiceData->burstExpected)
+                audio_playback_flush();
+            return;
+        }
+        double error = (now - spiceData->nextTime) * 1.0e-9;
+        int expected = min((int)(error / spiceData->periodSec) + 1, PLAYBACK_MAX_BURST);
+        if (expected > 1 && error < 0.2) {
+            spiceData->burstPackets = 1;
+            spiceData->burstExpected = expected;
+            spiceData->burstTime = now;
+            return;
+        }
+    }
+
+    playback_process(now, frames, 1, periodChanged, init);
+}
+
+void audio_playback_flush(void) {
+    PlaybackSpiceData *spiceData = &audio.playback.spiceData;
+    if (audio.playback.state != STREAM_STATE_RUN || !spiceData->burstPackets)
+        return;
+
+    int packets = spiceData->burstPackets;
+    spiceData->burstPackets = 0;
+    playback_process(spiceData->burstTime, packets * spiceData->periodFrames,
+                     packets, false, false);
+}
@@ -27,6 +27,7 @@ struct audio_opts {
 
     const char *sink; // optional
     const char *source; // optional
+    const char *tap; // optional, shm name to publish the resampled playback to (see audiotap.h)
 
     void (*latency_cb)(double current_offset_ms, double total_latency_ms, double device_latency_ms);
 };
@@ -36,6 +37,7 @@ void audio_playback_stop(void);
 void audio_playback_volume(int channels, const uint16_t volume[]);
 void audio_playback_mute(bool mute);
 void audio_playback_data(uint8_t *data, size_t size);
+void audio_playback_flush(void); // call after handling pending spice messages, in case a burst of late packets was cut short
 
 void audio_record_start(int channels, int sampleRate, PSAudioFormat format);
 void audio_record_stop(void);
@@ -43,6 +45,7 @@ void audio_record_volume(int channels, const uint16_t volume[]);
 void audio_record_mute(bool mute);
 
 int audio_pull(uint8_t *dst, int frames);
+void audio_playback_device_changed(void); // called by audiodev when the stream is moved to a sink on another clock
 void audio_push(uint8_t *data, int frames);
 
 bool audio_init(const struct audio_opts *opts);
@@ -26,11 +26,14 @@
 #include <spa/param/audio/format-utils.h>
 #include <spa/param/props.h>
 
+#include "lg_common/array.h"
 #include "lg_common/debug.h"
 #include "lg_common/util.h"
 
 #include "audio.h"
 #include "audiodev.h"
+#include "schedprobe.h"
+#include "watchdog.h"
 
 typedef enum {
     STREAM_STATE_INACTIVE,
@@ -38,6 +41,34 @@ typedef enum {
     STREAM_STATE_DRAINING
 } StreamState;
 
+// Number of playback streams to keep connected at once
+#define PLAYBACK_POOL_SIZE 4
+
+/* Formats to connect playback streams for ahead of time, so a guest switching
+ * between them doesn't have to wait for a new stream to be negotiated and
+ * linked before it can start playing */
+static const struct {
+    int channels;
+    int sampleRate;
+} playbackPoolFormats[] = {
+    {2, 48000},
+    {2, 44100},
+};
+
+typedef struct {
+    struct pw_stream *stream;
+    struct spa_io_rate_match *rateMatch;
+    struct spa_io_position *position;
+    uint32_t driver; // node driving the graph while active, or SPA_ID_INVALID
+
+    int channels;
+    int sampleRate;
+    int maxPeriodFrames;
+    int startFrames;
+
+    uint64_t lastUsed;
+} PlaybackStream;
+
 struct PipeWire {
     struct pw_loop *loop;
     struct pw_context *context;
@@ -45,8 +76,11 @@ struct PipeWire {
 
     struct
     {
-        struct pw_stream *stream;
-        struct spa_io_rate_match *rateMatch;
+        PlaybackStream pool[PLAYBACK_POOL_SIZE];
+        PlaybackStream *active;
+        uint64_t useCounter;
+
+        struct pw_stream *stream; // active->stream, or NULL
         struct pw_time time;
 
         int channels;
@@ -56,6 +90,11 @@ struct PipeWire {
         int startFrames;
 
         StreamState state;
+
+        // The process callback runs on the data loop thread, so it is
+        // registered with the watchdog and probe the first time it's called
+        bool threadRegistered;
+        int watchdog;
     } playback;
 
     struct
@@ -73,25 +112,30 @@ struct PipeWire {
 static struct PipeWire pw = {0};
 
 static void audiodev_on_playback_io_changed(void *userdata, uint32_t id, void *data, uint32_t size) {
+    PlaybackStream *ps = userdata;
     switch (id) {
     case SPA_IO_RateMatch:
-        pw.playback.rateMatch = data;
+        ps->rateMatch = data;
+        break;
+
+    case SPA_IO_Position:
+        ps->position = data;
         break;
     }
 }
 
-static void audiodev_on_playback_process(void *userdata) {
+static void audiodev_playback_process(PlaybackStream *ps) {
     struct pw_buffer *pbuf;
 
 #if PW_CHECK_VERSION(0, 3, 50)
-    if (pw_stream_get_time_n(pw.playback.stream, &pw.playback.time,
+    if (pw_stream_get_time_n(ps->stream, &pw.playback.time,
                              sizeof(pw.playback.time)) < 0)
 #else
-    if (pw_stream_get_time(pw.playback.stream, &pw.playback.time) < 0)
+    if (pw_stream_get_time(ps->stream, &pw.playback.time) < 0)
 #endif
         DEBUG_ERROR("pw_stream_get_time failed");
 
-    if (!(pbuf = pw_stream_dequeue_buffer(pw.playback.stream))) {
+    if (!(pbuf = pw_stream_dequeue_buffer(ps->stream))) {
         DEBUG_WARN("out of buffers");
         return;
     }
@@ -103,13 +147,13 @@ static void audiodev_on_playback_process(void *userdata) {
         return;
 
     int frames = sbuf->datas[0].maxsize / pw.playback.stride;
-    if (pw.playback.rateMatch && pw.playback.rateMatch->size > 0)
-        frames = min(frames, pw.playback.rateMatch->size);
+    if (ps->rateMatch && ps->rateMatch->size > 0)
+        frames = min(frames, ps->rateMatch->size);
 
     frames = audio_pull(dst, frames);
     if (!frames) {
         sbuf->datas[0].chunk->size = 0;
-        pw_stream_queue_buffer(pw.playback.stream, pbuf);
+        pw_stream_queue_buffer(ps->stream, pbuf);
         return;
     }
 
@@ -118,13 +162,44 @@ static void audiodev_on_playback_process(void *userdata) {
     sbuf->datas[0].chunk->stride = pw.playback.stride;
     sbuf->datas[0].chunk->size = frames * pw.playback.stride;
 
-    pw_stream_queue_buffer(pw.playback.stream, pbuf);
+    pw_stream_queue_buffer(ps->stream, pbuf);
+}
+
+static void audiodev_on_playback_process(void *userdata) {
+    PlaybackStream *ps = userdata;
+
+    // Streams waiting in the pool shouldn't be running, but make sure they
+    // never pull audio meant for the active one
+    if (ps != pw.playback.active)
+        return;
+
+    if (!pw.playback.threadRegistered) {
+        pw.playback.watchdog = watchdog_register("pw-playback", 250, NULL);
+        schedprobe_match_thread("pw-playback");
+        pw.playback.threadRegistered = true;
+    }
+    watchdog_busy(pw.playback.watchdog);
+
+    /* The first cycle tells us which node is driving us. If that changes while
+     * we are running, we have been moved to a sink on another clock. */
+    uint32_t driver = ps->position ? ps->position->clock.id : SPA_ID_INVALID;
+    if (driver != ps->driver) {
+        if (ps->driver != SPA_ID_INVALID && driver != SPA_ID_INVALID)
+            audio_playback_device_changed();
+        ps->driver = driver;
+    }
+
+    audiodev_playback_process(ps);
+    watchdog_idle(pw.playback.watchdog);
 }
 
 static void audiodev_onPlaybackDrained(void *userdata) {
+    PlaybackStream *ps = userdata;
     pw_thread_loop_lock(pw.thread);
-    pw_stream_set_active(pw.playback.stream, false);
-    pw.playback.state = STREAM_STATE_INACTIVE;
+    pw_stream_set_active(ps->stream, false);
+    ps->driver = SPA_ID_INVALID;
+    if (ps == pw.playback.active)
+        pw.playback.state = STREAM_STATE_INACTIVE;
     pw_thread_loop_unlock(pw.thread);
 }
 
@@ -168,21 +243,29 @@ err:
     return false;
 }
 
-static void audiodev_playback_stop_stream(void) {
-    if (!pw.playback.stream)
+// Must be called with the thread loop locked
+static void audiodev_playback_destroy_stream(PlaybackStream *ps) {
+    if (!ps->stream)
         return;
 
+    if (ps == pw.playback.active) {
+        pw.playback.active = NULL;
+        pw.playback.stream = NULL;
+        pw.playback.state = STREAM_STATE_INACTIVE;
+    }
+    pw_stream_destroy(ps->stream);
+    *ps = (PlaybackStream){0};
+}
+
+static void audiodev_playback_stop_stream(void) {
     pw_thread_loop_lock(pw.thread);
-    pw_stream_destroy(pw.playback.stream);
-    pw.playback.stream = NULL;
-    pw.playback.rateMatch = NULL;
+    for (int i = 0; i < PLAYBACK_POOL_SIZE; ++i)
+        audiodev_playback_destroy_stream(&pw.playback.pool[i]);
     pw_thread_loop_unlock(pw.thread);
 }
 
-void audiodev_playback_setup(const char *sink, int channels, int sampleRate, int requestedPeriodFrames, int *maxPeriodFrames, int *startFrames) {
-    const struct spa_pod *params[1];
-    uint8_t buffer[1024];
-    struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+// Must be called with the thread loop locked
+static bool audiodev_playback_create_stream(PlaybackStream *ps, const char *sink, int channels, int sampleRate, int requestedPeriodFrames) {
     static const struct pw_stream_events events =
         {
             .version = PW_VERSION_STREAM_EVENTS,
@@ -190,25 +273,19 @@ void audiodev_playback_setup(const char *sink, int channels, int sampleRate, int
             .process = audiodev_on_playback_process,
             .drained = audiodev_onPlaybackDrained};
 
-    if (pw.playback.stream &&
-        pw.playback.channels == channels &&
-        pw.playback.sampleRate == sampleRate) {
-        *maxPeriodFrames = pw.playback.maxPeriodFrames;
-        *startFrames = pw.playback.startFrames;
-        return;
-    }
-
-    audiodev_playback_stop_stream();
-
     char requestedNodeLatency[32];
     snprintf(requestedNodeLatency, sizeof(requestedNodeLatency), "%d/%d",
              requestedPeriodFrames, sampleRate);
 
-    pw.playback.channels = channels;
-    pw.playback.sampleRate = sampleRate;
-    pw.playback.stride = sizeof(float) * channels;
+    // All the pooled streams have the same node name, so tell them apart by format
+    char mediaName[32];
+    snprintf(mediaName, sizeof(mediaName), "%d Hz %dch", sampleRate, channels);
 
-    pw_thread_loop_lock(pw.thread);
+    *ps = (PlaybackStream){
+        .driver = SPA_ID_INVALID,
+        .channels = channels,
+        .sampleRate = sampleRate,
+    };
 
     struct pw_properties *props =
         pw_properties_new(
@@ -217,25 +294,31 @@ void audiodev_playback_setup(const char *sink, int channels, int sampleRate, int
             PW_KEY_MEDIA_CATEGORY, "Playback",
             PW_KEY_MEDIA_ROLE, "Game",
             PW_KEY_NODE_LATENCY, requestedNodeLatency,
+            PW_KEY_MEDIA_NAME, mediaName,
             NULL);
 
     if (sink) {
         pw_properties_set(props, PW_KEY_TARGET_OBJECT, sink);
     }
 
-    pw.playback.stream = pw_stream_new_simple(
+    ps->stream = pw_stream_new_simple(
         pw.loop,
         "spicy-kvm",
         props,
         &events,
-        NULL);
+        ps);
+
+    if (!ps->stream) {
+        DEBUG_ERROR("Failed to create the stream");
+        return false;
+    }
 
     // The user can override the default node latency with the audiodev_LATENCY
     // environment variable, so get the actual node latency value from the stream.
     // The actual quantum size may be lower than this value depending on what else
     // is using the audio device, but we can treat this value as a maximum
     const struct pw_properties *properties =
-        pw_stream_get_properties(pw.playback.stream);
+        pw_stream_get_properties(ps->stream);
     const char *actualNodeLatency =
         pw_properties_get(properties, PW_KEY_NODE_LATENCY);
     DEBUG_ASSERT(actualNodeLatency != NULL);
@@ -251,25 +334,20 @@ void audiodev_playback_setup(const char *sink, int channels, int sampleRate, int
 
         struct spa_dict_item items[] = {
             {PW_KEY_NODE_LATENCY, requestedNodeLatency}};
-        pw_stream_update_properties(pw.playback.stream,
+        pw_stream_update_properties(ps->stream,
                                     &SPA_DICT_INIT_ARRAY(items));
 
-        pw.playback.maxPeriodFrames = requestedPeriodFrames;
+        ps->maxPeriodFrames = requestedPeriodFrames;
     } else
-        pw.playback.maxPeriodFrames = num;
+        ps->maxPeriodFrames = num;
 
     // If the previous quantum size was very small, PipeWire can request two full
     // periods almost immediately at the start of playback
-    pw.playback.startFrames = pw.playback.maxPeriodFrames * 2;
-
-    *maxPeriodFrames = pw.playback.maxPeriodFrames;
-    *startFrames = pw.playback.startFrames;
+    ps->startFrames = ps->maxPeriodFrames * 2;
 
-    if (!pw.playback.stream) {
-        pw_thread_loop_unlock(pw.thread);
-        DEBUG_ERROR("Failed to create the stream");
-        return;
-    }
+    const struct spa_pod *params[1];
+    uint8_t buffer[1024];
+    struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
 
     params[0] = spa_format_audio_raw_build(&b, SPA_PARAM_EnumFormat,
                                            &SPA_AUDIO_INFO_RAW_INIT(
@@ -278,7 +356,7 @@ void audiodev_playback_setup(const char *sink, int channels, int sampleRate, int
                                                    .rate = sampleRate));
 
     pw_stream_connect(
-        pw.playback.stream,
+        ps->stream,
         PW_DIRECTION_OUTPUT,
         PW_ID_ANY,
         PW_STREAM_FLAG_AUTOCONNECT |
@@ -286,8 +364,109 @@ void audiodev_playback_setup(const char *sink, int channels, int sampleRate, int
             PW_STREAM_FLAG_RT_PROCESS |
             PW_STREAM_FLAG_INACTIVE,
         params, 1);
+    return true;
+}
+
+// Must be called with the thread loop locked
+static PlaybackStream *audiodev_playback_find_stream(int channels, int sampleRate) {
+    for (int i = 0; i < PLAYBACK_POOL_SIZE; ++i) {
+        PlaybackStream *ps = &pw.playback.pool[i];
+        if (ps->stream && ps->channels == channels && ps->sampleRate == sampleRate)
+            return ps;
+    }
+    return NULL;
+}
+
+/* Returns an empty pool slot, making room by destroying the least recently used
+ * inactive stream if needed. Must be called with the thread loop locked. */
+static PlaybackStream *audiodev_playback_alloc_stream(void) {
+    PlaybackStream *lru = NULL;
+    for (int i = 0; i < PLAYBACK_POOL_SIZE; ++i) {
+        PlaybackStream *ps = &pw.playback.pool[i];
+        if (!ps->stream)
+            return ps;
+        if (ps != pw.playback.active && (!lru || ps->lastUsed < lru->lastUsed))
+            lru = ps;
+    }
+    audiodev_playback_destroy_stream(lru);
+    return lru;
+}
+
+bool audiodev_playback_setup(const char *sink, int channels, int sampleRate, int requestedPeriodFrames, int *maxPeriodFrames, int *startFrames) {
+    if (pw.playback.active &&
+        pw.playback.channels == channels &&
+        pw.playback.sampleRate == sampleRate) {
+        *maxPeriodFrames = pw.playback.maxPeriodFrames;
+        *startFrames = pw.playback.startFrames;
+        return true;
+    }
+
+    pw_thread_loop_lock(pw.thread);
+
+    /* Park the current stream. It is kept connected so switching back to this
+     * format later is just a matter of activating it again. If it is still
+     * draining, cancel that, otherwise the drain could complete after it has
+     * been reactivated and stop it again. */
+    if (pw.playback.active) {
+        if (pw.playback.state == STREAM_STATE_DRAINING)
+            pw_stream_flush(pw.playback.stream, false);
+        if (pw.playback.state != STREAM_STATE_INACTIVE)
+            pw_stream_set_active(pw.playback.stream, false);
+        pw.playback.active->driver = SPA_ID_INVALID;
+        pw.playback.active = NULL;
+        pw.playback.stream = NULL;
+        pw.playback.state = STREAM_STATE_INACTIVE;
+    }
+
+    /* Parked streams stay linked wherever the session manager put them. If the
+     * user moved the active stream, that isn't carried over to the others:
+     * all we can see from here is the node driving the graph, which for
+     * filter chains and virtual sinks is the hardware behind them rather than
+     * the sink that was chosen, so relinking to it would bypass the user's
+     * choice. */
+    PlaybackStream *ps = audiodev_playback_find_stream(channels, sampleRate);
+    if (!ps) {
+        ps = audiodev_playback_alloc_stream();
+        if (!audiodev_playback_create_stream(ps, sink, channels, sampleRate, requestedPeriodFrames)) {
+            pw_thread_loop_unlock(pw.thread);
+            return false;
+        }
+    }
+
+    // Fill the pool with the common formats if it hasn't been already
+    for (int i = 0; i < (int)ARRAY_LENGTH(playbackPoolFormats); ++i) {
+        if (audiodev_playback_find_stream(playbackPoolFormats[i].channels,
+                                          playbackPoolFormats[i].sampleRate))
+            continue;
+
+        PlaybackStream *slot = NULL;
+        for (int j = 0; j < PLAYBACK_POOL_SIZE && !slot; ++j)
+            if (!pw.playback.pool[j].stream)
+                slot = &pw.playback.pool[j];
+        if (!slot)
+            break;
+
+        audiodev_playback_create_stream(slot, sink,
+                                        playbackPoolFormats[i].channels,
+                                        playbackPoolFormats[i].sampleRate,
+                                        requestedPeriodFrames);
+    }
+
+    ps->lastUsed = ++pw.playback.useCounter;
+    pw.playback.active = ps;
+    pw.playback.stream = ps->stream;
+    pw.playback.time = (struct pw_time){0};
+    pw.playback.channels = ps->channels;
+    pw.playback.sampleRate = ps->sampleRate;
+    pw.playback.stride = sizeof(float) * ps->channels;
+    pw.playback.maxPeriodFrames = ps->maxPeriodFrames;
+    pw.playback.startFrames = ps->startFrames;
 
     pw_thread_loop_unlock(pw.thread);
+
+    *maxPeriodFrames = pw.playback.maxPeriodFrames;
+    *startFrames = pw.playback.startFrames;
+    return true;
 }
 
 void audiodev_playback_start(void) {
@@ -2,7 +2,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-void audiodev_playback_setup(const char *sink, int channels, int sampleRate, int requestedPeriodFrames, int *maxPeriodFrames, int *startFrames);
+bool audiodev_playback_setup(const char *sink, int channels, int sampleRate, int requestedPeriodFrames, int *maxPeriodFrames, int *startFrames);
 void audiodev_playback_start(void);
 void audiodev_playback_stop(void);
 void audiodev_playback_volume(int channels, const uint16_t volume[]);
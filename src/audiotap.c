@@ -0,0 +1,148 @@
+/**
+ * Copyright © 2024 Patrick Gaskin
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "audiotap.h"
+
+// enough for about 2.7 seconds of 8 channel 48 kHz audio
+#define AUDIOTAP_DATA_SIZE (4 << 20)
+
+static struct {
+    char name[256];
+    struct audiotap_header *hdr;
+    float *data;
+    size_t size;
+} tap = {0};
+
+bool audiotap_open(const char *name) {
+    if (tap.hdr) {
+        return true;
+    }
+    if (snprintf(tap.name, sizeof(tap.name), "/%s", name) >= (int)sizeof(tap.name)) {
+        fprintf(stderr, "audiotap: name too long\n");
+        return false;
+    }
+
+    // readers only need read access
+    int fd = shm_open(tap.name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "audiotap: failed to open /dev/shm%s: %s\n", tap.name, strerror(errno));
+        return false;
+    }
+
+    size_t header_size = (sizeof(struct audiotap_header) + 63) & ~(size_t)63;
+    tap.size = header_size + AUDIOTAP_DATA_SIZE;
+
+    if (ftruncate(fd, tap.size) == -1) {
+        fprintf(stderr, "audiotap: failed to resize /dev/shm%s: %s\n", tap.name, strerror(errno));
+        close(fd);
+        shm_unlink(tap.name);
+        return false;
+    }
+
+    void *mem = mmap(NULL, tap.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        fprintf(stderr, "audiotap: failed to map /dev/shm%s: %s\n", tap.name, strerror(errno));
+        shm_unlink(tap.name);
+        return false;
+    }
+
+    tap.hdr = mem;
+    tap.data = (float *)((uint8_t *)mem + header_size);
+
+    memcpy(tap.hdr->magic, AUDIOTAP_MAGIC, sizeof(tap.hdr->magic));
+    tap.hdr->version = AUDIOTAP_VERSION;
+    tap.hdr->header_size = header_size;
+    tap.hdr->data_size = AUDIOTAP_DATA_SIZE;
+    tap.hdr->format = AUDIOTAP_FORMAT_F32;
+    atomic_store_explicit(&tap.hdr->seq, 0, memory_order_release);
+
+    printf("audiotap: publishing playback to /dev/shm%s\n", tap.name);
+    return true;
+}
+
+static void audiotap_begin(void) {
+    atomic_store_explicit(&tap.hdr->seq, tap.hdr->seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void audiotap_end(void) {
+    atomic_store_explicit(&tap.hdr->seq, tap.hdr->seq + 1, memory_order_release);
+}
+
+void audiotap_format(int channels, int sampleRate) {
+    if (!tap.hdr) {
+        return;
+    }
+    audiotap_begin();
+    tap.hdr->generation++;
+    tap.hdr->channels = channels;
+    tap.hdr->sample_rate = sampleRate;
+    tap.hdr->capacity_frames = channels ? AUDIOTAP_DATA_SIZE / (channels * sizeof(float)) : 0;
+    tap.hdr->write_pos = 0;
+    tap.hdr->write_time_ns = 0;
+    tap.hdr->latency_ns = 0;
+    audiotap_end();
+}
+
+void audiotap_write(const float *frames, int count, int64_t latency_ns) {
+    if (!tap.hdr || !tap.hdr->channels || count <= 0) {
+        return;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    uint32_t channels = tap.hdr->channels;
+    uint32_t capacity = tap.hdr->capacity_frames;
+
+    audiotap_begin();
+    uint64_t pos = tap.hdr->write_pos;
+    while (count > 0) {
+        uint32_t off = pos % capacity;
+        uint32_t n = count;
+        if (n > capacity - off) {
+            n = capacity - off;
+        }
+        memcpy(tap.data + (size_t)off * channels, frames, (size_t)n * channels * sizeof(float));
+        frames += (size_t)n * channels;
+        count -= n;
+        pos += n;
+    }
+    tap.hdr->write_pos = pos;
+    tap.hdr->write_time_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    tap.hdr->latency_ns = latency_ns;
+    audiotap_end();
+}
+
+void audiotap_close(void) {
+    if (!tap.hdr) {
+        return;
+    }
+    munmap(tap.hdr, tap.size);
+    shm_unlink(tap.name);
+    tap.hdr = NULL;
+    tap.data = NULL;
+}
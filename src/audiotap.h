@@ -0,0 +1,67 @@
+#pragma once
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * The playback tap publishes the resampler output of the playback stream to a
+ * POSIX shared memory object so local tools can record it without adding a
+ * node to the PipeWire graph.
+ *
+ * This is what gets queued for the PipeWire device, except that silence padded
+ * in at startup or after underruns, and frames skipped or inserted to get back
+ * in sync with the guest, are not in the tap. The timing fields below are
+ * updated on every write, so they hold for recent frames but not across one of
+ * those gaps.
+ *
+ * The object (/dev/shm/NAME) consists of a struct audiotap_header followed by
+ * data_size bytes of interleaved native-endian float samples. Frame N of the
+ * stream is stored at byte offset (N % capacity_frames) * channels * 4 of the
+ * data area. All fields are native-endian.
+ *
+ * There is a single writer, and it never waits for readers. seq is odd while
+ * the writer is writing frames or updating the header. To read:
+ *
+ *  1. Take a snapshot: read seq until it is even, read the other header
+ *     fields, then read seq again and start over if it changed.
+ *  2. Copy the frames you need from [write_pos - capacity_frames, write_pos).
+ *  3. Take another snapshot. If generation changed, discard everything.
+ *     Otherwise, discard any copied frames older than the new
+ *     write_pos - capacity_frames since they may have been overwritten.
+ *
+ * A reader which falls more than capacity_frames behind has lost data and
+ * should skip ahead.
+ *
+ * Whenever the stream format changes, generation is incremented and write_pos
+ * is reset to zero. The object is never resized while it exists.
+ *
+ * write_time_ns is the CLOCK_MONOTONIC time at which the frame at write_pos-1
+ * was written, and latency_ns is the estimated time between a frame being
+ * written and it being heard, so the frame at position P is heard at about
+ * write_time_ns + latency_ns - (write_pos - 1 - P) * 1e9 / sample_rate.
+ */
+
+#define AUDIOTAP_MAGIC "SPKVTAP\0"
+#define AUDIOTAP_VERSION 1
+#define AUDIOTAP_FORMAT_F32 1
+
+struct audiotap_header {
+    char magic[8];          // AUDIOTAP_MAGIC
+    uint32_t version;       // AUDIOTAP_VERSION
+    uint32_t header_size;   // offset of the data area
+    uint32_t data_size;     // size of the data area in bytes
+    uint32_t format;        // AUDIOTAP_FORMAT_*
+    _Atomic uint64_t seq;   // odd while the writer is updating the header
+    uint32_t generation;    // incremented on every format change
+    uint32_t channels;      // 0 if there is no stream (e.g., playback stopped)
+    uint32_t sample_rate;
+    uint32_t capacity_frames;
+    uint64_t write_pos;     // total frames written this generation
+    int64_t write_time_ns;  // CLOCK_MONOTONIC
+    int64_t latency_ns;
+};
+
+bool audiotap_open(const char *name);
+void audiotap_format(int channels, int sampleRate);
+void audiotap_write(const float *frames, int count, int64_t latency_ns);
+void audiotap_close(void);
@@ -0,0 +1,263 @@
+/**
+ * Copyright © 2024 Patrick Gaskin
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dashboard.h"
+#include "input.h"
+#include "metrics.h"
+
+// the dashboard is drawn in the bottom DASHBOARD_LINES lines of the terminal,
+// and everything else scrolls above it
+#define DASHBOARD_LINES 8
+#define DASHBOARD_HISTORY 48
+
+struct dashboard_history {
+    float values[DASHBOARD_HISTORY];
+    int count;
+    int next;
+};
+
+static struct {
+    struct dashboard_opts opts;
+    pthread_t thread;
+    bool running;
+    atomic_bool stop;
+    int rows;
+
+    struct dashboard_history latency;
+    struct dashboard_history offset_error;
+    struct dashboard_history ratio;
+
+    int last_underruns;
+    uint64_t last_events[METRICS_MAX_INPUT_DEVICES];
+} dashboard = {
+    .opts = {
+        .enable = false,
+        .refresh_ms = 250,
+    },
+};
+
+static void dashboard_history_push(struct dashboard_history *h, float v) {
+    h->values[h->next] = v;
+    h->next = (h->next + 1) % DASHBOARD_HISTORY;
+    if (h->count < DASHBOARD_HISTORY) {
+        h->count++;
+    }
+}
+
+static int dashboard_sparkline(char *buf, size_t n, const struct dashboard_history *h, float *lo, float *hi) {
+    static const char *const blocks[] = {"▁", "▂", "▃", "▄", "▅", "▆", "▇", "█"};
+    int start = (h->next - h->count + DASHBOARD_HISTORY) % DASHBOARD_HISTORY;
+
+    *lo = INFINITY;
+    *hi = -INFINITY;
+    for (int i = 0; i < h->count; i++) {
+        float v = h->values[(start + i) % DASHBOARD_HISTORY];
+        *lo = fminf(*lo, v);
+        *hi = fmaxf(*hi, v);
+    }
+
+    int off = 0;
+    for (int i = 0; i < DASHBOARD_HISTORY; i++) {
+        const char *c = " ";
+        if (i >= DASHBOARD_HISTORY - h->count) {
+            float v = h->values[(start + i - (DASHBOARD_HISTORY - h->count)) % DASHBOARD_HISTORY];
+            int level = *hi > *lo ? (int)((v - *lo) / (*hi - *lo) * 7.0f + 0.5f) : 0;
+            c = blocks[level];
+        }
+        off += snprintf(buf + off, off < n ? n - off : 0, "%s", c);
+    }
+    if (!h->count) {
+        *lo = *hi = 0;
+    }
+    return off;
+}
+
+static const char *dashboard_ddc_str(int state) {
+    switch (state) {
+    case METRICS_DDC_DISABLED:
+        return "disabled";
+    case METRICS_DDC_UNAVAILABLE:
+        return "unavailable";
+    case METRICS_DDC_SELF:
+        return "this machine";
+    case METRICS_DDC_OTHER:
+        return "vm";
+    }
+    return "?";
+}
+
+static void dashboard_draw(void) {
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_row <= DASHBOARD_LINES + 1) {
+        return;
+    }
+
+    char out[4096];
+    int off = 0;
+#define OUT(...) off += snprintf(out + off, off < (int)sizeof(out) ? sizeof(out) - off : 0, __VA_ARGS__)
+
+    // keep the log output above the dashboard
+    if (ws.ws_row != dashboard.rows) {
+        dashboard.rows = ws.ws_row;
+
+        // scroll up to make room first, since if the cursor is already in the
+        // bottom lines, log output would be written over the dashboard (line
+        // feeds below the scroll region don't scroll), then move back up so the
+        // cursor ends up at or above the last line of the new scroll region
+        OUT("\033[r");
+        for (int i = 0; i < DASHBOARD_LINES; i++) {
+            OUT("\n");
+        }
+        OUT("\033[%dA", DASHBOARD_LINES);
+
+        // setting the scroll region also moves the cursor to the top left
+        OUT("\0337\033[1;%dr\0338", dashboard.rows - DASHBOARD_LINES);
+    }
+
+    float latency_ms = atomic_load_explicit(&metrics.audio.latency_ms, memory_order_relaxed);
+    float offset_error_ms = atomic_load_explicit(&metrics.audio.offset_error_ms, memory_order_relaxed);
+    double ratio = atomic_load_explicit(&metrics.audio.ratio, memory_order_relaxed);
+    int device_period_frames = atomic_load_explicit(&metrics.audio.device_period_frames, memory_order_relaxed);
+    int underruns = atomic_load_explicit(&metrics.audio.underruns, memory_order_relaxed);
+    bool playing = atomic_load_explicit(&metrics.audio.playing, memory_order_relaxed);
+    int ddc = atomic_load_explicit(&metrics.ddc, memory_order_relaxed);
+
+    if (playing) {
+        dashboard_history_push(&dashboard.latency, latency_ms);
+        dashboard_history_push(&dashboard.offset_error, offset_error_ms);
+        dashboard_history_push(&dashboard.ratio, (ratio - 1.0) * 1.0e6);
+    }
+
+    char spark[DASHBOARD_HISTORY * 4 + 1];
+    float lo, hi;
+
+    OUT("\0337\033[%d;1H", dashboard.rows - DASHBOARD_LINES + 1);
+
+    OUT("\033[K\033[7m grab %-3s  ddc %-12s  audio %-7s \033[0m\r\n",
+        input_is_grabbed() ? "yes" : "no",
+        dashboard_ddc_str(ddc),
+        playing ? "playing" : "idle");
+
+    dashboard_sparkline(spark, sizeof(spark), &dashboard.latency, &lo, &hi);
+    OUT("\033[K latency  %s %7.2f ms  [%.2f, %.2f]\r\n", spark, latency_ms, lo, hi);
+
+    dashboard_sparkline(spark, sizeof(spark), &dashboard.offset_error, &lo, &hi);
+    OUT("\033[K offset   %s %+7.2f ms  [%+.2f, %+.2f]\r\n", spark, offset_error_ms, lo, hi);
+
+    dashboard_sparkline(spark, sizeof(spark), &dashboard.ratio, &lo, &hi);
+    OUT("\033[K ratio    %s %+7.1f ppm [%+.1f, %+.1f]\r\n", spark, (ratio - 1.0) * 1.0e6, lo, hi);
+
+    OUT("\033[K device   quantum %d frames  underruns %d (+%d)\r\n",
+        device_period_frames, underruns, underruns - dashboard.last_underruns);
+    dashboard.last_underruns = underruns;
+
+    if (atomic_load_explicit(&metrics.sched.running, memory_order_relaxed)) {
+        OUT("\033[K sched    wakeup max %d us  p99 %d us  avg %.1f us\r\n",
+            atomic_load_explicit(&metrics.sched.max_us, memory_order_relaxed),
+            atomic_load_explicit(&metrics.sched.p99_us, memory_order_relaxed),
+            atomic_load_explicit(&metrics.sched.avg_us, memory_order_relaxed));
+    } else {
+        OUT("\033[K sched    (probe disabled)\r\n");
+    }
+
+    OUT("\033[K input   ");
+    int shown = 0;
+    for (int i = 0; i < METRICS_MAX_INPUT_DEVICES; i++) {
+        if (!atomic_load_explicit(&metrics.input[i].present, memory_order_acquire)) {
+            dashboard.last_events[i] = 0;
+            continue;
+        }
+        uint64_t events = atomic_load_explicit(&metrics.input[i].events, memory_order_relaxed);
+        uint64_t delta = events >= dashboard.last_events[i] ? events - dashboard.last_events[i] : events;
+        dashboard.last_events[i] = events;
+
+        // only show devices which are actually doing something
+        if (!delta) {
+            continue;
+        }
+        OUT(" %.24s %.0f/s", metrics.input[i].name, delta * 1000.0 / dashboard.opts.refresh_ms);
+        shown++;
+    }
+    if (!shown) {
+        OUT(" (no events)");
+    }
+    OUT("\r\n\033[K");
+
+    OUT("\0338");
+#undef OUT
+
+    fwrite(out, 1, off < (int)sizeof(out) ? off : (int)sizeof(out) - 1, stdout);
+    fflush(stdout);
+}
+
+static void *dashboard_thread(void *data) {
+    prctl(PR_SET_NAME, "dashboard");
+
+    const struct timespec ts = {
+        .tv_sec = dashboard.opts.refresh_ms / 1000,
+        .tv_nsec = (dashboard.opts.refresh_ms % 1000) * 1000000L,
+    };
+    while (!atomic_load(&dashboard.stop)) {
+        dashboard_draw();
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+bool dashboard_init(const struct dashboard_opts *opts) {
+    int rc;
+    if (opts) {
+        dashboard.opts = *opts;
+    }
+    if (dashboard.opts.refresh_ms <= 0) {
+        dashboard.opts.refresh_ms = 250;
+    }
+    if (!isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "dashboard: stdout is not a terminal\n");
+        return false;
+    }
+    metrics_enable();
+    if ((rc = pthread_create(&dashboard.thread, NULL, dashboard_thread, NULL))) {
+        return false; // rc is errno
+    }
+    dashboard.running = true;
+    return true;
+}
+
+void dashboard_free(void) {
+    if (!dashboard.running) {
+        return;
+    }
+    atomic_store(&dashboard.stop, true);
+    pthread_join(dashboard.thread, NULL);
+
+    // reset the scroll region and clear the dashboard
+    if (dashboard.rows) {
+        fprintf(stdout, "\0337\033[r\033[%d;1H\033[J\0338", dashboard.rows - DASHBOARD_LINES + 1);
+        fflush(stdout);
+    }
+}
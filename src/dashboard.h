@@ -0,0 +1,10 @@
+#pragma once
+#include <stdbool.h>
+
+struct dashboard_opts {
+    bool enable;
+    int refresh_ms;
+};
+
+bool dashboard_init(const struct dashboard_opts *opts);
+void dashboard_free(void);
@@ -33,6 +33,10 @@
 #include <systemd/sd-event.h>
 
 #include "input.h"
+#include "metrics.h"
+#include "usbhid.h"
+#include "vhostinput.h"
+#include "watchdog.h"
 
 static const uint32_t linux_to_ps2[KEY_MAX] = {
     // https://github.com/gnif/LookingGlass/blob/master/client/src/kb.c
@@ -182,22 +186,129 @@ static struct {
     struct libevdev *libevdev[MAX_INPUT_DEVICES];
 
     bool grab_key[KEY_MAX];
+    enum input_engine engine;
     ssize_t grabbed_keyboard;
     ssize_t grabbed_mouse;
 
     struct timeval grab_key_at;
     bool temp_ungrabbed_mouse;
+
+    int udev_watchdog;
 } input = {
     .grab_key = {
         [KEY_RIGHTCTRL] = true,
     },
+    .engine = INPUT_ENGINE_SPICE,
     .grabbed_keyboard = -1,
     .grabbed_mouse = -1,
+    .udev_watchdog = -1,
 };
 
 // TODO: proper logging
 
-static void input_ungrab(void) {
+static void input_send_key(int code, int value) {
+    if (input.engine == INPUT_ENGINE_USBHID) {
+        usbhid_key(code, value);
+        return;
+    }
+    if (input.engine == INPUT_ENGINE_VHOST) {
+        vhostinput_event(EV_KEY, code, value);
+        return;
+    }
+    if (linux_to_spice[code]) {
+        if (value == 1) {
+            if (!purespice_mousePress(linux_to_spice[code])) {
+                fprintf(stderr, "input: warning: failed to send packet\n");
+            }
+        }
+        if (value == 0) {
+            if (!purespice_mouseRelease(linux_to_spice[code])) {
+                fprintf(stderr, "input: warning: failed to send packet\n");
+            }
+        }
+    }
+    if (linux_to_ps2[code]) {
+        if (value == 1) {
+            if (!purespice_keyDown(linux_to_ps2[code])) {
+                fprintf(stderr, "input: warning: failed to send packet\n");
+            }
+        }
+        if (value == 0) {
+            if (!purespice_keyUp(linux_to_ps2[code])) {
+                fprintf(stderr, "input: warning: failed to send packet\n");
+            }
+        }
+    }
+}
+
+static void input_send_motion(int dx, int dy) {
+    if (input.engine == INPUT_ENGINE_USBHID) {
+        usbhid_rel(REL_X, dx);
+        usbhid_rel(REL_Y, dy);
+        return;
+    }
+    if (input.engine == INPUT_ENGINE_VHOST) {
+        if (dx) {
+            vhostinput_event(EV_REL, REL_X, dx);
+        }
+        if (dy) {
+            vhostinput_event(EV_REL, REL_Y, dy);
+        }
+        return;
+    }
+    if (!purespice_mouseMotion(dx, dy)) {
+        fprintf(stderr, "input: warning: failed to send packet\n");
+    }
+}
+
+static void input_send_wheel(int wheel, int hwheel) {
+    if (input.engine == INPUT_ENGINE_USBHID) {
+        usbhid_rel(REL_WHEEL, wheel);
+        usbhid_rel(REL_HWHEEL, hwheel);
+        return;
+    }
+    if (input.engine == INPUT_ENGINE_VHOST) {
+        if (wheel) {
+            vhostinput_event(EV_REL, REL_WHEEL, wheel);
+        }
+        if (hwheel) {
+            vhostinput_event(EV_REL, REL_HWHEEL, hwheel);
+        }
+        return;
+    }
+    // spice has no horizontal scrolling
+    if (wheel < 0) {
+        while (wheel++) {
+            if (!purespice_mousePress(SPICE_MOUSE_BUTTON_DOWN)) {
+                fprintf(stderr, "input: warning: failed to send packet\n");
+            }
+            if (!purespice_mouseRelease(SPICE_MOUSE_BUTTON_DOWN)) {
+                fprintf(stderr, "input: warning: failed to send packet\n");
+            }
+        }
+    } else if (wheel > 0) {
+        while (wheel--) {
+            if (!purespice_mousePress(SPICE_MOUSE_BUTTON_UP)) {
+                fprintf(stderr, "input: warning: failed to send packet\n");
+            }
+            if (!purespice_mouseRelease(SPICE_MOUSE_BUTTON_UP)) {
+                fprintf(stderr, "input: warning: failed to send packet\n");
+            }
+        }
+    }
+}
+
+static void input_send_sync(void) {
+    // usb hid mouse reports are sent once per evdev report, at the device's own rate
+    if (input.engine == INPUT_ENGINE_USBHID) {
+        usbhid_sync();
+    }
+    if (input.engine == INPUT_ENGINE_VHOST) {
+        vhostinput_sync();
+    }
+}
+
+static void input_ungrab_devices(void) {
     int rc;
     if (input.grabbed_keyboard != -1) {
         if (input.libevdev[input.grabbed_keyboard]) {
@@ -224,6 +335,34 @@ static void input_ungrab(void) {
     }
 }
 
+static void input_ungrab(void) {
+    if (input.engine == INPUT_ENGINE_USBHID) {
+        usbhid_release_all();
+    }
+    if (input.engine == INPUT_ENGINE_VHOST) {
+        vhostinput_release_all();
+    }
+    input_ungrab_devices();
+}
+
+void input_ungrab_stalled(const char *thread) {
+    fprintf(stderr, "input: warning: %s is stuck, ungrabbing everything\n", thread);
+
+    // the stuck thread may be holding the engine lock while blocked in a send,
+    // so give the devices back first and don't wait for the engine
+    input_ungrab_devices();
+    bool released = true;
+    if (input.engine == INPUT_ENGINE_USBHID) {
+        released = usbhid_try_release_all();
+    }
+    if (input.engine == INPUT_ENGINE_VHOST) {
+        released = vhostinput_try_release_all();
+    }
+    if (!released) {
+        fprintf(stderr, "input: warning: input engine is busy, keys may remain held down in the guest\n");
+    }
+}
+
 static uint64_t tv_ms_diff(const struct timeval *a, const struct timeval *b) {
     uint64_t msa = (a->tv_sec * (uint64_t)(1000LL)) + (a->tv_usec / 1000);
     uint64_t msb = (b->tv_sec * (uint64_t)(1000LL)) + (b->tv_usec / 1000);
@@ -238,6 +377,9 @@ static void *input_device_thread(void *data) {
     // set the thread name for easier debugging
     prctl(PR_SET_NAME, name); // can be seen in pstree -t
 
+    // if we get stuck forwarding an event, the device is probably grabbed with nothing receiving the input
+    int wd = watchdog_register(name, 1000, input_ungrab_stalled);
+
     // loop variables
     // note: if we send a mouse motion event out of range, spice will freeze up!?! (I noticed this when I accidentally forgot to initialize the state struct and the mouse offset was ridiculously high)
     struct {
@@ -245,6 +387,7 @@ static void *input_device_thread(void *data) {
         int dx;
         int dy;
         int wheel;
+        int hwheel;
     } pending_rel = {0};
     struct {
         bool ignore;
@@ -257,7 +400,10 @@ static void *input_device_thread(void *data) {
 
 loop:
     // read an event
-    if ((rc = libevdev_next_event(input.libevdev[idx], (sync == -1 ? LIBEVDEV_READ_FLAG_NORMAL : LIBEVDEV_READ_FLAG_SYNC)|LIBEVDEV_READ_FLAG_BLOCKING, &ev)) < 0) {
+    watchdog_idle(wd);
+    rc = libevdev_next_event(input.libevdev[idx], (sync == -1 ? LIBEVDEV_READ_FLAG_NORMAL : LIBEVDEV_READ_FLAG_SYNC)|LIBEVDEV_READ_FLAG_BLOCKING, &ev);
+    watchdog_busy(wd);
+    if (rc < 0) {
         if (rc == -EAGAIN) {
             if (sync != -1) {
                 printf("input: synced %s in %d events\n", name, sync);
@@ -281,6 +427,11 @@ loop:
         sync++;
     }
 
+    // count reports before the grab checks, so devices which aren't grabbed still show up
+    if (ev.type == EV_SYN && ev.code == SYN_REPORT) {
+        metrics_input_event(idx);
+    }
+
     // check for the grab key
     if (ev.type == EV_KEY && input.grab_key[ev.code]) {
         // store the key down time
@@ -382,30 +533,7 @@ loop:
     if (ev.type == EV_KEY) {
         // send keys immediately rather than waiting for a report (spice sends each up/down as a single message anyways, and latency is noticeably better this way)
         // doing it this way also eliminates an odd bug where keys feel sticky due to missing events when many keys are pressed quickly
-        if (linux_to_spice[ev.code]) {
-            if (ev.value == 1) {
-                if (!purespice_mousePress(linux_to_spice[ev.code])) {
-                    fprintf(stderr, "input: warning: failed to send packet\n");
-                }
-            }
-            if (ev.value == 0) {
-                if (!purespice_mouseRelease(linux_to_spice[ev.code])) {
-                    fprintf(stderr, "input: warning: failed to send packet\n");
-                }
-            }
-        }
-        if (linux_to_ps2[ev.code]) {
-            if (ev.value == 1) {
-                if (!purespice_keyDown(linux_to_ps2[ev.code])) {
-                    fprintf(stderr, "input: warning: failed to send packet\n");
-                }
-            }
-            if (ev.value == 0) {
-                if (!purespice_keyUp(linux_to_ps2[ev.code])) {
-                    fprintf(stderr, "input: warning: failed to send packet\n");
-                }
-            }
-        }
+        input_send_key(ev.code, ev.value);
         if (ev.code == BTN_TOUCH) {
             if (ev.value == 1) {
                 pending_rel_fake.touch = true;
@@ -429,6 +557,9 @@ loop:
         if (ev.code == REL_WHEEL) {
             pending_rel.wheel += ev.value;
         }
+        if (ev.code == REL_HWHEEL) {
+            pending_rel.hwheel += ev.value;
+        }
         pending_rel_fake.ignore = true;
     }
     if (ev.type == EV_ABS) {
@@ -454,42 +585,23 @@ loop:
     if (ev.type == EV_SYN && ev.code == SYN_REPORT) {
         if (pending_rel.ok) {
             if (pending_rel.dx || pending_rel.dy) {
-                if (!purespice_mouseMotion(pending_rel.dx, pending_rel.dy)) {
-                    fprintf(stderr, "input: warning: failed to send packet\n");
-                }
+                input_send_motion(pending_rel.dx, pending_rel.dy);
             }
-            if (pending_rel.wheel < 0) {
-                while (pending_rel.wheel++) {
-                    if (!purespice_mousePress(SPICE_MOUSE_BUTTON_DOWN)) {
-                        fprintf(stderr, "input: warning: failed to send packet\n");
-                    }
-                    if (!purespice_mouseRelease(SPICE_MOUSE_BUTTON_DOWN)) {
-                        fprintf(stderr, "input: warning: failed to send packet\n");
-                    }
-                }
-            } else if (pending_rel.wheel > 0) {
-                while (pending_rel.wheel--) {
-                    if (!purespice_mousePress(SPICE_MOUSE_BUTTON_UP)) {
-                        fprintf(stderr, "input: warning: failed to send packet\n");
-                    }
-                    if (!purespice_mouseRelease(SPICE_MOUSE_BUTTON_UP)) {
-                        fprintf(stderr, "input: warning: failed to send packet\n");
-                    }
-                }
+            if (pending_rel.wheel || pending_rel.hwheel) {
+                input_send_wheel(pending_rel.wheel, pending_rel.hwheel);
             }
             pending_rel.ok = false;
-            pending_rel.dx = pending_rel.dy = pending_rel.wheel = 0;
+            pending_rel.dx = pending_rel.dy = pending_rel.wheel = pending_rel.hwheel = 0;
         }
         if (!pending_rel_fake.ignore) {
             if (pending_rel_fake.touch) {
                 if (pending_rel_fake.dx || pending_rel_fake.dy) {
-                    if (!purespice_mouseMotion(pending_rel_fake.dx, pending_rel_fake.dy)) {
-                        fprintf(stderr, "input: warning: failed to send packet\n");
-                    }
+                    input_send_motion(pending_rel_fake.dx, pending_rel_fake.dy);
                 }
                 pending_rel_fake.dx = pending_rel_fake.dy = 0;
             }
         }
+        input_send_sync();
     }
 
     // continue reading events
@@ -500,6 +612,7 @@ end:
     printf("input: no longer tracking %s\n", libevdev_get_name(input.libevdev[idx]) ?: "(no name)");
 
     // close the input device (this also ungrabs it if it is grabbed)
+    metrics_input_device(idx, NULL);
     close(libevdev_get_fd(input.libevdev[idx]));
     libevdev_free(input.libevdev[idx]);
     input.libevdev[idx] = NULL;
@@ -520,6 +633,7 @@ end:
     }
 
     // exit the thread
+    watchdog_unregister(wd);
     return 0;
 }
 
@@ -594,6 +708,8 @@ static int input_add_device(sd_device *device) {
         is_supported_kbd ? "yes" : "no",
         (is_supported_pointer_rel|is_supported_pointer_fake_rel) ? (is_supported_pointer_fake_rel ? "fake_relative" : "relative") : "no");
 
+    metrics_input_device(idx, name ?: "(no name)");
+
     pthread_t input_thread;
     if ((rc = pthread_create(&input_thread, NULL, input_device_thread, (void*)(int64_t)idx))) {
         return -rc;
@@ -604,6 +720,7 @@ static int input_add_device(sd_device *device) {
 static void *input_udev_thread(void *data) {
     int rc;
     prctl(PR_SET_NAME, "udev");
+    input.udev_watchdog = watchdog_register("udev", 2000, NULL);
     if ((rc = sd_event_loop(input.sd_event)) < 1) {
         // TODO: log fatal error
     }
@@ -618,7 +735,9 @@ static int input_udev_handler(sd_device_monitor *m, sd_device *device, void *use
         return 0;
     }
     if (action == SD_DEVICE_ADD) {
+        watchdog_busy(input.udev_watchdog);
         input_add_device(device);
+        watchdog_idle(input.udev_watchdog);
     }
     return 0;
 }
@@ -630,6 +749,17 @@ bool input_init(const struct input_opts *opts) {
         for (int i = 0; i < KEY_MAX; i++) {
             input.grab_key[i] = opts->grab_key[i];
         }
+        input.engine = opts->engine;
+    }
+    if (input.engine == INPUT_ENGINE_USBHID) {
+        if (!usbhid_init(&opts->usbhid)) {
+            return false;
+        }
+    }
+    if (input.engine == INPUT_ENGINE_VHOST) {
+        if (!vhostinput_init(&opts->vhost)) {
+            return false;
+        }
     }
     if ((rc = sd_event_new(&input.sd_event)) < 0) {
         return false; // rc is -errno
@@ -2,10 +2,25 @@
 #include <stdbool.h>
 #include <linux/input-event-codes.h>
 
+#include "usbhid.h"
+#include "vhostinput.h"
+
+enum input_engine {
+    INPUT_ENGINE_SPICE,  // ps/2 keyboard and spice mouse over the spice inputs channel
+    INPUT_ENGINE_USBHID, // synthetic usb hid keyboard and mouse over usbredir (see usbhid.h)
+    INPUT_ENGINE_VHOST,  // vhost-user-input backend for vms on the same host (see vhostinput.h)
+};
+
 struct input_opts {
     bool grab_key[KEY_MAX];
+    enum input_engine engine;
+    struct usbhid_opts usbhid; // for INPUT_ENGINE_USBHID
+    struct vhostinput_opts vhost; // for INPUT_ENGINE_VHOST
 };
 
 bool input_init(const struct input_opts *opts);
 bool input_is_grabbed(void);
 
+// releases all grabs as a safety valve, for use as a watchdog stall callback
+void input_ungrab_stalled(const char *thread);
+
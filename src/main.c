@@ -31,8 +31,12 @@
 #include <unistd.h>
 
 #include "audio.h"
+#include "dashboard.h"
 #include "ddcci.h"
 #include "input.h"
+#include "metrics.h"
+#include "schedprobe.h"
+#include "watchdog.h"
 
 struct ddc_opts {
     bool enable;
@@ -118,6 +122,7 @@ int main(int argc, char **argv) {
         .buffer_latency = 12,
         .sink = NULL,
         .source = NULL,
+        .tap = NULL,
         .latency_cb = on_audio_latency,
     };
     const struct input_opts input = {
@@ -125,6 +130,14 @@ int main(int argc, char **argv) {
             [KEY_RIGHTCTRL] = true,
             [KEY_PAUSE] = true,
         },
+        .engine = INPUT_ENGINE_SPICE,
+        .usbhid = {
+            .host = "10.33.0.137",
+            .port = 4000,
+        },
+        .vhost = {
+            .path = "/tmp/spicy-kvm-input.sock",
+        },
         // TODO: option for temporary grab key (hold down to redirect input without changing grab or display state)
     };
     const struct ddc_opts ddc = {
@@ -133,6 +146,19 @@ int main(int argc, char **argv) {
         .output_self = 0x11,
         .output_other = 0x12,
     };
+    const struct dashboard_opts dashboard = {
+        .enable = false,
+        .refresh_ms = 250,
+    };
+    const struct watchdog_opts watchdog = {
+        .enable = true,
+        .interval_ms = 100,
+        .backtrace = true,
+    };
+    const struct schedprobe_opts schedprobe = {
+        .enable = false,
+        .interval_us = 1000,
+    };
     bool linger = true;
 
     // TODO: cli opts for host, port, password, input enable, playback enable, playback sink, record enable, record source, ddc enable, ddc outputs, ddc card, input grab keys, linger
@@ -141,6 +167,27 @@ int main(int argc, char **argv) {
     struct ddcci ddcci;
     bool ddcci_ok = false;
 
+    if (watchdog.enable) {
+        fprintf(stdout, "info: initializing watchdog\n");
+        if (!watchdog_init(&watchdog)) {
+            fprintf(stderr, "warning: failed to initialize watchdog\n");
+        }
+    }
+
+    if (dashboard.enable) {
+        fprintf(stdout, "info: initializing dashboard\n");
+        if (!dashboard_init(&dashboard)) {
+            fprintf(stderr, "warning: failed to initialize dashboard\n");
+        }
+    }
+
+    if (schedprobe.enable) {
+        fprintf(stdout, "info: initializing scheduling latency probe\n");
+        if (!schedprobe_init(&schedprobe)) {
+            fprintf(stderr, "warning: failed to initialize scheduling latency probe\n");
+        }
+    }
+
     if (config.playback.enable || config.record.enable) {
         fprintf(stdout, "info: initializing audio\n");
         if (!audio_init(&audio)) {
@@ -168,6 +215,7 @@ int main(int argc, char **argv) {
             fprintf(stdout, "info: using i2c %d for '%s'\n", i2c, ddc.drm);
             ddcci_ok = true;
         }
+        metrics_ddc(ddcci_ok ? METRICS_DDC_SELF : METRICS_DDC_UNAVAILABLE);
     }
 
     fprintf(stdout, "info: connecting to spice server\n");
@@ -196,12 +244,21 @@ int main(int argc, char **argv) {
     signal(SIGTERM, sighandler);
     signal(SIGQUIT, sighandler);
 
+    // this thread runs the spice connection (including audio playback data and
+    // forwarded input) and the ddc switching, so it should never be stuck for long
+    int wd = watchdog_register("main", 3000, input_ungrab_stalled);
+
     bool was_grabbed = false;
     while (!should_exit) {
+        watchdog_busy(wd);
         if (purespice_process(1) != PS_STATUS_RUN) {
             fprintf(stderr, "fatal: failed to run spice server connection\n");
             return 1;
         }
+        if (config.playback.enable) {
+            // normally a no-op, since bursts are processed when the last packet arrives
+            audio_playback_flush();
+        }
         bool is_grabbed = input_is_grabbed();
         if (is_grabbed != was_grabbed) {
             if (ddc.enable) {
@@ -224,6 +281,8 @@ int main(int argc, char **argv) {
                             fprintf(stderr, "warning: failed to switch display output: %s\n", ddcci_strerror(rc));
                             ddcci_close(&ddcci);
                             ddcci_ok = false;
+                        } else {
+                            metrics_ddc(METRICS_DDC_OTHER);
                         }
                     } else {
                         fprintf(stdout, "info: switching display outputs\n");
@@ -231,10 +290,15 @@ int main(int argc, char **argv) {
                             fprintf(stderr, "warning: failed to switch display output: %s\n", ddcci_strerror(rc));
                             ddcci_close(&ddcci);
                             ddcci_ok = false;
+                        } else {
+                            metrics_ddc(METRICS_DDC_SELF);
                         }
                     }
                     fprintf(stdout, "info: switched display outputs\n");
                 }
+                if (!ddcci_ok) {
+                    metrics_ddc(METRICS_DDC_UNAVAILABLE);
+                }
             }
             if (was_grabbed && !is_grabbed) {
                 if (linger) {
@@ -249,10 +313,14 @@ int main(int argc, char **argv) {
     }
 
     fprintf(stdout, "info: cleaning up\n");
+    watchdog_unregister(wd);
     if (ddcci_ok) {
         ddcci_close(&ddcci);
     }
     purespice_disconnect();
     audio_free();
+    dashboard_free();
+    schedprobe_free();
+    watchdog_free();
     return 0;
 }
@@ -0,0 +1,40 @@
+/**
+ * Copyright © 2024 Patrick Gaskin
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+#include <stdio.h>
+
+#include "metrics.h"
+
+struct metrics metrics = {0};
+
+void metrics_enable(void) {
+    metrics.enabled = true;
+}
+
+void metrics_input_device(int idx, const char *name) {
+    if (!metrics.enabled || idx < 0 || idx >= METRICS_MAX_INPUT_DEVICES) {
+        return;
+    }
+    if (name) {
+        atomic_store_explicit(&metrics.input[idx].present, false, memory_order_release);
+        snprintf(metrics.input[idx].name, sizeof(metrics.input[idx].name), "%s", name);
+        atomic_store_explicit(&metrics.input[idx].events, 0, memory_order_relaxed);
+        atomic_store_explicit(&metrics.input[idx].present, true, memory_order_release);
+    } else {
+        atomic_store_explicit(&metrics.input[idx].present, false, memory_order_release);
+    }
+}
@@ -0,0 +1,96 @@
+#pragma once
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Lock-free live metrics, written from the audio, input, main, and scheduling
+ * probe threads and sampled by the dashboard. Every field is independently
+ * atomic, so a reader may see values from slightly different moments, but will
+ * never block a writer. Updates are skipped entirely unless metrics_enable was
+ * called.
+ */
+
+#define METRICS_MAX_INPUT_DEVICES 64
+
+enum metrics_ddc {
+    METRICS_DDC_DISABLED,
+    METRICS_DDC_UNAVAILABLE,
+    METRICS_DDC_SELF,
+    METRICS_DDC_OTHER,
+};
+
+struct metrics {
+    bool enabled;
+
+    struct {
+        _Atomic float latency_ms;       // total playback latency
+        _Atomic float offset_error_ms;  // filtered offset from the target latency
+        _Atomic double ratio;           // resampler ratio
+        atomic_int device_period_frames;
+        atomic_int underruns;
+        atomic_int playing;
+    } audio;
+
+    struct {
+        atomic_bool present;
+        char name[64];                  // may be torn while a device is added
+        _Atomic uint64_t events;        // reports read, whether or not they were forwarded
+    } input[METRICS_MAX_INPUT_DEVICES];
+
+    atomic_int ddc; // enum metrics_ddc
+
+    struct {
+        atomic_bool running;
+        atomic_int max_us;              // worst wakeup latency in the last second
+        atomic_int p99_us;
+        _Atomic float avg_us;
+    } sched;
+};
+
+extern struct metrics metrics;
+
+void metrics_enable(void);
+
+static inline void metrics_audio_playback(double latency_ms, double offset_error_ms, double ratio, int device_period_frames, int underruns) {
+    if (!metrics.enabled) {
+        return;
+    }
+    atomic_store_explicit(&metrics.audio.latency_ms, latency_ms, memory_order_relaxed);
+    atomic_store_explicit(&metrics.audio.offset_error_ms, offset_error_ms, memory_order_relaxed);
+    atomic_store_explicit(&metrics.audio.ratio, ratio, memory_order_relaxed);
+    atomic_store_explicit(&metrics.audio.device_period_frames, device_period_frames, memory_order_relaxed);
+    atomic_store_explicit(&metrics.audio.underruns, underruns, memory_order_relaxed);
+}
+
+static inline void metrics_audio_playing(bool playing) {
+    if (!metrics.enabled) {
+        return;
+    }
+    atomic_store_explicit(&metrics.audio.playing, playing, memory_order_relaxed);
+}
+
+void metrics_input_device(int idx, const char *name);
+
+static inline void metrics_input_event(int idx) {
+    if (!metrics.enabled) {
+        return;
+    }
+    atomic_fetch_add_explicit(&metrics.input[idx].events, 1, memory_order_relaxed);
+}
+
+static inline void metrics_ddc(enum metrics_ddc state) {
+    if (!metrics.enabled) {
+        return;
+    }
+    atomic_store_explicit(&metrics.ddc, state, memory_order_relaxed);
+}
+
+static inline void metrics_sched(int max_us, int p99_us, double avg_us) {
+    if (!metrics.enabled) {
+        return;
+    }
+    atomic_store_explicit(&metrics.sched.max_us, max_us, memory_order_relaxed);
+    atomic_store_explicit(&metrics.sched.p99_us, p99_us, memory_order_relaxed);
+    atomic_store_explicit(&metrics.sched.avg_us, avg_us, memory_order_relaxed);
+}
@@ -0,0 +1,258 @@
+/**
+ * Copyright © 2024 Patrick Gaskin
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+#define _GNU_SOURCE // for cpu_set_t and pthread_*affinity_np
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <time.h>
+
+#include "metrics.h"
+#include "schedprobe.h"
+
+// results are summarized and published once per window
+#define SCHEDPROBE_WINDOW_NS 1000000000LL
+#define SCHEDPROBE_WINDOW_MAX_SAMPLES 10000
+
+// upper bounds of the histogram buckets printed on exit, in microseconds
+static const int schedprobe_buckets[] = {5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000};
+#define SCHEDPROBE_BUCKETS (sizeof(schedprobe_buckets) / sizeof(*schedprobe_buckets) + 1)
+
+static struct {
+    struct schedprobe_opts opts;
+    pthread_t thread;
+    bool running;
+    atomic_bool stop;
+
+    // set once by schedprobe_match_thread, then picked up by the probe thread
+    atomic_int match; // 0 = none, 1 = being written, 2 = ready, 3 = applied
+    char match_name[32];
+    int match_policy;
+    struct sched_param match_param;
+    cpu_set_t match_cpus;
+    bool match_cpus_ok;
+
+    // current window
+    int64_t window_start;
+    int window_count;
+    int window_samples[SCHEDPROBE_WINDOW_MAX_SAMPLES]; // us
+    int64_t window_sum;
+    int window_max;
+
+    // totals
+    uint64_t hist[SCHEDPROBE_BUCKETS];
+    uint64_t total_count;
+    int64_t total_sum;
+    int total_max;
+    double baseline_p99; // smoothed p99 over previous windows
+    int last_underruns;
+} schedprobe = {
+    .opts = {
+        .enable = false,
+        .interval_us = 1000,
+    },
+};
+
+static int64_t schedprobe_ts_ns(const struct timespec *ts) {
+    return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static int schedprobe_cmp(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+static void schedprobe_apply(void) {
+    int rc;
+    printf("schedprobe: matching scheduling of %s (policy %d, priority %d)\n",
+        schedprobe.match_name, schedprobe.match_policy, schedprobe.match_param.sched_priority);
+    if ((rc = pthread_setschedparam(pthread_self(), schedprobe.match_policy, &schedprobe.match_param))) {
+        fprintf(stderr, "schedprobe: warning: failed to set scheduling policy: %s (results will not reflect %s)\n", strerror(rc), schedprobe.match_name);
+    }
+    if (schedprobe.match_cpus_ok) {
+        if ((rc = pthread_setaffinity_np(pthread_self(), sizeof(schedprobe.match_cpus), &schedprobe.match_cpus))) {
+            fprintf(stderr, "schedprobe: warning: failed to set cpu affinity: %s\n", strerror(rc));
+        }
+    }
+}
+
+static void schedprobe_window_end(int64_t now) {
+    if (!schedprobe.window_count) {
+        return;
+    }
+    qsort(schedprobe.window_samples, schedprobe.window_count, sizeof(int), schedprobe_cmp);
+    int p99 = schedprobe.window_samples[(schedprobe.window_count - 1) * 99 / 100];
+    double avg = (double)schedprobe.window_sum / schedprobe.window_count;
+
+    metrics_sched(schedprobe.window_max, p99, avg);
+
+    /* If the audio device underran during this window, say whether the host
+     * was also slow to wake us up. A wakeup much later than usual points at
+     * the kernel or contention with the vm's vcpus, while normal wakeups
+     * point at spicy-kvm itself or the guest's packet pacing. */
+    if (metrics.enabled) {
+        int underruns = atomic_load_explicit(&metrics.audio.underruns, memory_order_relaxed);
+        if (underruns > schedprobe.last_underruns && schedprobe.baseline_p99 > 0) {
+            bool slow = schedprobe.window_max > 500 && schedprobe.window_max > schedprobe.baseline_p99 * 4;
+            printf("schedprobe: %d playback underrun(s) in the last second, wakeup latency max %d us p99 %d us (usually %.0f us): %s\n",
+                underruns - schedprobe.last_underruns, schedprobe.window_max, p99, schedprobe.baseline_p99,
+                slow ? "scheduling delays likely contributed" : "scheduling looks normal");
+        }
+        schedprobe.last_underruns = underruns;
+    }
+
+    if (schedprobe.baseline_p99 == 0) {
+        schedprobe.baseline_p99 = p99;
+    } else {
+        schedprobe.baseline_p99 += (p99 - schedprobe.baseline_p99) * 0.1;
+    }
+
+    schedprobe.window_start = now;
+    schedprobe.window_count = 0;
+    schedprobe.window_sum = 0;
+    schedprobe.window_max = 0;
+}
+
+static void schedprobe_record(int latency_us) {
+    size_t b = 0;
+    while (b < SCHEDPROBE_BUCKETS - 1 && latency_us >= schedprobe_buckets[b]) {
+        b++;
+    }
+    schedprobe.hist[b]++;
+    schedprobe.total_count++;
+    schedprobe.total_sum += latency_us;
+    if (latency_us > schedprobe.total_max) {
+        schedprobe.total_max = latency_us;
+    }
+
+    if (schedprobe.window_count < SCHEDPROBE_WINDOW_MAX_SAMPLES) {
+        schedprobe.window_samples[schedprobe.window_count++] = latency_us;
+        schedprobe.window_sum += latency_us;
+    }
+    if (latency_us > schedprobe.window_max) {
+        schedprobe.window_max = latency_us;
+    }
+}
+
+static void *schedprobe_main(void *data) {
+    prctl(PR_SET_NAME, "schedprobe");
+
+    int64_t interval_ns = schedprobe.opts.interval_us * 1000LL;
+    struct timespec next, now;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    schedprobe.window_start = schedprobe_ts_ns(&next);
+
+    while (!atomic_load(&schedprobe.stop)) {
+        int expected = 2;
+        if (atomic_compare_exchange_strong(&schedprobe.match, &expected, 3)) {
+            schedprobe_apply();
+        }
+
+        next.tv_nsec += interval_ns;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) {
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        int64_t late = schedprobe_ts_ns(&now) - schedprobe_ts_ns(&next);
+        schedprobe_record(late > 0 ? (int)(late / 1000) : 0);
+
+        // don't try to catch up on missed wakeups after a long stall
+        if (late > interval_ns) {
+            next = now;
+        }
+        if (schedprobe_ts_ns(&now) - schedprobe.window_start >= SCHEDPROBE_WINDOW_NS) {
+            schedprobe_window_end(schedprobe_ts_ns(&now));
+        }
+    }
+    return NULL;
+}
+
+bool schedprobe_init(const struct schedprobe_opts *opts) {
+    int rc;
+    if (opts) {
+        schedprobe.opts = *opts;
+    }
+    if (!schedprobe.opts.enable) {
+        return true;
+    }
+    if (schedprobe.opts.interval_us <= 0) {
+        schedprobe.opts.interval_us = 1000;
+    }
+    metrics_enable();
+    if ((rc = pthread_create(&schedprobe.thread, NULL, schedprobe_main, NULL))) {
+        return false; // rc is errno
+    }
+    schedprobe.running = true;
+    atomic_store(&metrics.sched.running, true);
+    return true;
+}
+
+void schedprobe_free(void) {
+    if (!schedprobe.running) {
+        return;
+    }
+    atomic_store(&schedprobe.stop, true);
+    pthread_join(schedprobe.thread, NULL);
+    schedprobe.running = false;
+
+    if (!schedprobe.total_count) {
+        return;
+    }
+    printf("schedprobe: wakeup latency over %llu samples: avg %.1f us, max %d us\n",
+        (unsigned long long)schedprobe.total_count,
+        (double)schedprobe.total_sum / schedprobe.total_count,
+        schedprobe.total_max);
+    for (size_t b = 0; b < SCHEDPROBE_BUCKETS; b++) {
+        if (!schedprobe.hist[b]) {
+            continue;
+        }
+        if (b < SCHEDPROBE_BUCKETS - 1) {
+            printf("schedprobe:   < %5d us: %10llu (%6.3f%%)\n", schedprobe_buckets[b],
+                (unsigned long long)schedprobe.hist[b], schedprobe.hist[b] * 100.0 / schedprobe.total_count);
+        } else {
+            printf("schedprobe:  >= %5d us: %10llu (%6.3f%%)\n", schedprobe_buckets[b - 1],
+                (unsigned long long)schedprobe.hist[b], schedprobe.hist[b] * 100.0 / schedprobe.total_count);
+        }
+    }
+}
+
+void schedprobe_match_thread(const char *name) {
+    if (!schedprobe.running) {
+        return;
+    }
+    int expected = 0;
+    if (!atomic_compare_exchange_strong(&schedprobe.match, &expected, 1)) {
+        return;
+    }
+    snprintf(schedprobe.match_name, sizeof(schedprobe.match_name), "%s", name);
+    if (pthread_getschedparam(pthread_self(), &schedprobe.match_policy, &schedprobe.match_param)) {
+        schedprobe.match_policy = SCHED_OTHER;
+        schedprobe.match_param = (struct sched_param){0};
+    }
+    schedprobe.match_policy &= ~SCHED_RESET_ON_FORK;
+    schedprobe.match_cpus_ok = !pthread_getaffinity_np(pthread_self(), sizeof(schedprobe.match_cpus), &schedprobe.match_cpus);
+    atomic_store(&schedprobe.match, 2);
+}
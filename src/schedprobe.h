@@ -0,0 +1,22 @@
+#pragma once
+#include <stdbool.h>
+
+/*
+ * A cyclictest-style probe which repeatedly sleeps until an absolute deadline
+ * and measures how late it wakes up. Once the audio device thread has been
+ * seen, the probe copies its scheduling policy, priority, and affinity, so the
+ * measured latency is what that thread would see from the host scheduler.
+ * Results are published through metrics.h and printed as a histogram on exit.
+ */
+
+struct schedprobe_opts {
+    bool enable;
+    int interval_us; // how often to wake up
+};
+
+bool schedprobe_init(const struct schedprobe_opts *opts);
+void schedprobe_free(void);
+
+// makes the probe run with the same scheduling policy and affinity as the
+// calling thread (only the first call has any effect)
+void schedprobe_match_thread(const char *name);
@@ -0,0 +1,979 @@
+/**
+ * Copyright © 2024 Patrick Gaskin
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+#include <endian.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <linux/input-event-codes.h>
+
+#include "usbhid.h"
+
+// https://gitlab.freedesktop.org/spice/usbredir/-/blob/main/docs/usb-redirection-protocol.md
+
+enum {
+    usb_redir_hello = 0,
+    usb_redir_device_connect = 1,
+    usb_redir_device_disconnect = 2,
+    usb_redir_reset = 3,
+    usb_redir_interface_info = 4,
+    usb_redir_ep_info = 5,
+    usb_redir_set_configuration = 6,
+    usb_redir_get_configuration = 7,
+    usb_redir_configuration_status = 8,
+    usb_redir_set_alt_setting = 9,
+    usb_redir_get_alt_setting = 10,
+    usb_redir_alt_setting_status = 11,
+    usb_redir_start_interrupt_receiving = 15,
+    usb_redir_stop_interrupt_receiving = 16,
+    usb_redir_interrupt_receiving_status = 17,
+    usb_redir_control_packet = 100,
+    usb_redir_interrupt_packet = 103,
+};
+
+enum {
+    usb_redir_cap_connect_device_version = 1,
+    usb_redir_cap_ep_info_max_packet_size = 4,
+};
+
+enum {
+    usb_redir_success = 0,
+    usb_redir_inval = 2,
+    usb_redir_stall = 4,
+};
+
+enum {
+    usb_redir_speed_full = 1,
+};
+
+enum {
+    usb_redir_type_control = 0,
+    usb_redir_type_interrupt = 3,
+    usb_redir_type_invalid = 255,
+};
+
+// we never advertise usb_redir_cap_64bits_ids, so ids are always 32-bit
+struct usb_redir_header {
+    uint32_t type;
+    uint32_t length;
+    uint32_t id;
+} __attribute__((packed));
+
+struct usb_redir_device_connect_header {
+    uint8_t speed;
+    uint8_t device_class;
+    uint8_t device_subclass;
+    uint8_t device_protocol;
+    uint16_t vendor_id;
+    uint16_t product_id;
+    uint16_t device_version_bcd;
+} __attribute__((packed));
+
+struct usb_redir_interface_info_header {
+    uint32_t interface_count;
+    uint8_t interface[32];
+    uint8_t interface_class[32];
+    uint8_t interface_subclass[32];
+    uint8_t interface_protocol[32];
+} __attribute__((packed));
+
+struct usb_redir_ep_info_header {
+    uint8_t type[32];
+    uint8_t interval[32];
+    uint8_t interface[32];
+    uint16_t max_packet_size[32];
+} __attribute__((packed));
+
+struct usb_redir_control_packet_header {
+    uint8_t endpoint;
+    uint8_t request;
+    uint8_t requesttype;
+    uint8_t status;
+    uint16_t value;
+    uint16_t index;
+    uint16_t length;
+} __attribute__((packed));
+
+struct usb_redir_interrupt_packet_header {
+    uint8_t endpoint;
+    uint8_t status;
+    uint16_t length;
+} __attribute__((packed));
+
+#define USBHID_EP_KEYBOARD 0x81
+#define USBHID_EP_MOUSE 0x82
+
+// usbredir endpoint array index
+#define USBHID_EP_IDX(ep) ((((ep) & 0x80) >> 3) | ((ep) & 0x0f))
+
+static const uint8_t usbhid_keyboard_report_desc[] = {
+    0x05, 0x01,       // usage page (generic desktop)
+    0x09, 0x06,       // usage (keyboard)
+    0xA1, 0x01,       // collection (application)
+    0x05, 0x07,       //   usage page (keyboard)
+    0x19, 0xE0,       //   usage minimum (left control)
+    0x29, 0xE7,       //   usage maximum (right gui)
+    0x15, 0x00,       //   logical minimum (0)
+    0x25, 0x01,       //   logical maximum (1)
+    0x75, 0x01,       //   report size (1)
+    0x95, 0x08,       //   report count (8)
+    0x81, 0x02,       //   input (data, variable, absolute)
+    0x95, 0x01,       //   report count (1)
+    0x75, 0x08,       //   report size (8)
+    0x81, 0x01,       //   input (constant)
+    0x95, 0x05,       //   report count (5)
+    0x75, 0x01,       //   report size (1)
+    0x05, 0x08,       //   usage page (leds)
+    0x19, 0x01,       //   usage minimum (num lock)
+    0x29, 0x05,       //   usage maximum (kana)
+    0x91, 0x02,       //   output (data, variable, absolute)
+    0x95, 0x01,       //   report count (1)
+    0x75, 0x03,       //   report size (3)
+    0x91, 0x01,       //   output (constant)
+    0x95, 0x06,       //   report count (6)
+    0x75, 0x08,       //   report size (8)
+    0x15, 0x00,       //   logical minimum (0)
+    0x26, 0xFF, 0x00, //   logical maximum (255)
+    0x05, 0x07,       //   usage page (keyboard)
+    0x19, 0x00,       //   usage minimum (0)
+    0x2A, 0xFF, 0x00, //   usage maximum (255)
+    0x81, 0x00,       //   input (data, array)
+    0xC0,             // end collection
+};
+
+static const uint8_t usbhid_mouse_report_desc[] = {
+    0x05, 0x01,       // usage page (generic desktop)
+    0x09, 0x02,       // usage (mouse)
+    0xA1, 0x01,       // collection (application)
+    0x09, 0x01,       //   usage (pointer)
+    0xA1, 0x00,       //   collection (physical)
+    0x05, 0x09,       //     usage page (buttons)
+    0x19, 0x01,       //     usage minimum (1)
+    0x29, 0x05,       //     usage maximum (5)
+    0x15, 0x00,       //     logical minimum (0)
+    0x25, 0x01,       //     logical maximum (1)
+    0x95, 0x05,       //     report count (5)
+    0x75, 0x01,       //     report size (1)
+    0x81, 0x02,       //     input (data, variable, absolute)
+    0x95, 0x01,       //     report count (1)
+    0x75, 0x03,       //     report size (3)
+    0x81, 0x01,       //     input (constant)
+    0x05, 0x01,       //     usage page (generic desktop)
+    0x09, 0x30,       //     usage (x)
+    0x09, 0x31,       //     usage (y)
+    0x16, 0x01, 0x80, //     logical minimum (-32767)
+    0x26, 0xFF, 0x7F, //     logical maximum (32767)
+    0x75, 0x10,       //     report size (16)
+    0x95, 0x02,       //     report count (2)
+    0x81, 0x06,       //     input (data, variable, relative)
+    0x09, 0x38,       //     usage (wheel)
+    0x15, 0x81,       //     logical minimum (-127)
+    0x25, 0x7F,       //     logical maximum (127)
+    0x75, 0x08,       //     report size (8)
+    0x95, 0x01,       //     report count (1)
+    0x81, 0x06,       //     input (data, variable, relative)
+    0x05, 0x0C,       //     usage page (consumer)
+    0x0A, 0x38, 0x02, //     usage (ac pan)
+    0x95, 0x01,       //     report count (1)
+    0x81, 0x06,       //     input (data, variable, relative)
+    0xC0,             //   end collection
+    0xC0,             // end collection
+};
+
+static const uint8_t usbhid_device_desc[] = {
+    18, 0x01,         // device
+    0x00, 0x02,       // usb 2.0
+    0x00, 0x00, 0x00, // class defined by interface
+    64,               // ep0 max packet size
+    0x09, 0x12,       // vendor (pid.codes)
+    0x01, 0x00,       // product (pid.codes test pid)
+    0x00, 0x01,       // device 1.0
+    1, 2, 0,          // manufacturer, product, serial strings
+    1,                // configurations
+};
+
+#define USBHID_HID_DESC(report_desc) \
+    9, 0x21, 0x11, 0x01, 0x00, 1, 0x22, sizeof(report_desc) & 0xFF, sizeof(report_desc) >> 8
+
+static const uint8_t usbhid_config_desc[] = {
+    9, 0x02, 59, 0, 2, 1, 0, 0xA0, 50,           // configuration (bus powered, remote wakeup, 100 mA)
+    9, 0x04, 0, 0, 1, 0x03, 0x01, 0x01, 0,       // interface 0 (hid, boot, keyboard)
+    USBHID_HID_DESC(usbhid_keyboard_report_desc),
+    7, 0x05, USBHID_EP_KEYBOARD, 0x03, 8, 0, 1,  // endpoint (interrupt in, 8 bytes, 1 ms)
+    9, 0x04, 1, 0, 1, 0x03, 0x01, 0x02, 0,       // interface 1 (hid, boot, mouse)
+    USBHID_HID_DESC(usbhid_mouse_report_desc),
+    7, 0x05, USBHID_EP_MOUSE, 0x03, 8, 0, 1,     // endpoint (interrupt in, 8 bytes, 1 ms)
+};
+
+static const char *const usbhid_strings[] = {
+    [1] = "spicy-kvm",
+    [2] = "spicy-kvm HID",
+};
+
+static const uint8_t linux_to_hid[KEY_MAX] = {
+    // from the linux_to_ps2 table in input.c
+   [KEY_ESC]               = 0x29,
+   [KEY_1]                 = 0x1E,
+   [KEY_2]                 = 0x1F,
+   [KEY_3]                 = 0x20,
+   [KEY_4]                 = 0x21,
+   [KEY_5]                 = 0x22,
+   [KEY_6]                 = 0x23,
+   [KEY_7]                 = 0x24,
+   [KEY_8]                 = 0x25,
+   [KEY_9]                 = 0x26,
+   [KEY_0]                 = 0x27,
+   [KEY_MINUS]             = 0x2D,
+   [KEY_EQUAL]             = 0x2E,
+   [KEY_BACKSPACE]         = 0x2A,
+   [KEY_TAB]               = 0x2B,
+   [KEY_Q]                 = 0x14,
+   [KEY_W]                 = 0x1A,
+   [KEY_E]                 = 0x08,
+   [KEY_R]                 = 0x15,
+   [KEY_T]                 = 0x17,
+   [KEY_Y]                 = 0x1C,
+   [KEY_U]                 = 0x18,
+   [KEY_I]                 = 0x0C,
+   [KEY_O]                 = 0x12,
+   [KEY_P]                 = 0x13,
+   [KEY_LEFTBRACE]         = 0x2F,
+   [KEY_RIGHTBRACE]        = 0x30,
+   [KEY_ENTER]             = 0x28,
+   [KEY_LEFTCTRL]          = 0xE0,
+   [KEY_A]                 = 0x04,
+   [KEY_S]                 = 0x16,
+   [KEY_D]                 = 0x07,
+   [KEY_F]                 = 0x09,
+   [KEY_G]                 = 0x0A,
+   [KEY_H]                 = 0x0B,
+   [KEY_J]                 = 0x0D,
+   [KEY_K]                 = 0x0E,
+   [KEY_L]                 = 0x0F,
+   [KEY_SEMICOLON]         = 0x33,
+   [KEY_APOSTROPHE]        = 0x34,
+   [KEY_GRAVE]             = 0x35,
+   [KEY_LEFTSHIFT]         = 0xE1,
+   [KEY_BACKSLASH]         = 0x31,
+   [KEY_Z]                 = 0x1D,
+   [KEY_X]                 = 0x1B,
+   [KEY_C]                 = 0x06,
+   [KEY_V]                 = 0x19,
+   [KEY_B]                 = 0x05,
+   [KEY_N]                 = 0x11,
+   [KEY_M]                 = 0x10,
+   [KEY_COMMA]             = 0x36,
+   [KEY_DOT]               = 0x37,
+   [KEY_SLASH]             = 0x38,
+   [KEY_RIGHTSHIFT]        = 0xE5,
+   [KEY_KPASTERISK]        = 0x55,
+   [KEY_LEFTALT]           = 0xE2,
+   [KEY_SPACE]             = 0x2C,
+   [KEY_CAPSLOCK]          = 0x39,
+   [KEY_F1]                = 0x3A,
+   [KEY_F2]                = 0x3B,
+   [KEY_F3]                = 0x3C,
+   [KEY_F4]                = 0x3D,
+   [KEY_F5]                = 0x3E,
+   [KEY_F6]                = 0x3F,
+   [KEY_F7]                = 0x40,
+   [KEY_F8]                = 0x41,
+   [KEY_F9]                = 0x42,
+   [KEY_F10]               = 0x43,
+   [KEY_NUMLOCK]           = 0x53,
+   [KEY_SCROLLLOCK]        = 0x47,
+   [KEY_KP7]               = 0x5F,
+   [KEY_KP8]               = 0x60,
+   [KEY_KP9]               = 0x61,
+   [KEY_KPMINUS]           = 0x56,
+   [KEY_KP4]               = 0x5C,
+   [KEY_KP5]               = 0x5D,
+   [KEY_KP6]               = 0x5E,
+   [KEY_KPPLUS]            = 0x57,
+   [KEY_KP1]               = 0x59,
+   [KEY_KP2]               = 0x5A,
+   [KEY_KP3]               = 0x5B,
+   [KEY_KP0]               = 0x62,
+   [KEY_KPDOT]             = 0x63,
+   [KEY_102ND]             = 0x64,
+   [KEY_F11]               = 0x44,
+   [KEY_F12]               = 0x45,
+   [KEY_RO]                = 0x87,
+   [KEY_HENKAN]            = 0x8A,
+   [KEY_KATAKANAHIRAGANA]  = 0x88,
+   [KEY_MUHENKAN]          = 0x8B,
+   [KEY_KPENTER]           = 0x58,
+   [KEY_RIGHTCTRL]         = 0xE4,
+   [KEY_KPSLASH]           = 0x54,
+   [KEY_SYSRQ]             = 0x46,
+   [KEY_RIGHTALT]          = 0xE6,
+   [KEY_HOME]              = 0x4A,
+   [KEY_UP]                = 0x52,
+   [KEY_PAGEUP]            = 0x4B,
+   [KEY_LEFT]              = 0x50,
+   [KEY_RIGHT]             = 0x4F,
+   [KEY_END]               = 0x4D,
+   [KEY_DOWN]              = 0x51,
+   [KEY_PAGEDOWN]          = 0x4E,
+   [KEY_INSERT]            = 0x49,
+   [KEY_DELETE]            = 0x4C,
+   [KEY_KPEQUAL]           = 0x67,
+   [KEY_PAUSE]             = 0x48,
+   [KEY_KPCOMMA]           = 0x85,
+   [KEY_HANGEUL]           = 0x90,
+   [KEY_HANJA]             = 0x91,
+   [KEY_YEN]               = 0x89,
+   [KEY_LEFTMETA]          = 0xE3,
+   [KEY_RIGHTMETA]         = 0xE7,
+   [KEY_COMPOSE]           = 0x65,
+   [KEY_F13]               = 0x68,
+   [KEY_F14]               = 0x69,
+   [KEY_F15]               = 0x6A,
+   [KEY_PRINT]             = 0x46,
+   [KEY_MUTE]              = 0x7F,
+   [KEY_VOLUMEUP]          = 0x80,
+   [KEY_VOLUMEDOWN]        = 0x81,
+};
+
+static const uint8_t linux_to_hid_button[KEY_MAX] = {
+    [BTN_LEFT]   = 1 << 0,
+    [BTN_RIGHT]  = 1 << 1,
+    [BTN_MIDDLE] = 1 << 2,
+    [BTN_SIDE]   = 1 << 3,
+    [BTN_EXTRA]  = 1 << 4,
+};
+
+static struct {
+    struct usbhid_opts opts;
+    pthread_mutex_t lock;
+
+    int fd; // -1 if not connected
+    bool peer_connect_device_version;
+    bool peer_ep_info_max_packet_size;
+    uint32_t next_id;
+
+    uint8_t configuration;
+    uint8_t protocol[2]; // per interface, 0 is boot, 1 is report
+    uint8_t idle[2];
+    bool receiving[2];
+
+    struct {
+        uint8_t modifiers;
+        uint8_t keys[16]; // in the order they were pressed
+        int count;
+    } keyboard;
+
+    struct {
+        uint8_t buttons;
+        uint8_t last_buttons;
+        int dx, dy, wheel, hwheel;
+    } mouse;
+} usbhid = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .fd = -1,
+};
+
+// must be called with the lock held
+static bool usbhid_send(uint32_t type, uint32_t id, const void *hdr, size_t hdr_len, const void *data, size_t data_len) {
+    if (usbhid.fd == -1) {
+        return false;
+    }
+
+    uint8_t buf[sizeof(struct usb_redir_header) + 256 + 256];
+    if (hdr_len + data_len > sizeof(buf) - sizeof(struct usb_redir_header)) {
+        return false;
+    }
+
+    struct usb_redir_header h = {
+        .type = htole32(type),
+        .length = htole32(hdr_len + data_len),
+        .id = htole32(id),
+    };
+    memcpy(buf, &h, sizeof(h));
+    memcpy(buf + sizeof(h), hdr, hdr_len);
+    if (data_len) {
+        memcpy(buf + sizeof(h) + hdr_len, data, data_len);
+    }
+
+    size_t n = sizeof(h) + hdr_len + data_len;
+    for (size_t off = 0; off < n;) {
+        ssize_t w = send(usbhid.fd, buf + off, n - off, MSG_NOSIGNAL);
+        if (w == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "usbhid: warning: failed to send packet: %s\n", strerror(errno));
+            shutdown(usbhid.fd, SHUT_RDWR);
+            return false;
+        }
+        off += w;
+    }
+    return true;
+}
+
+// must be called with the lock held
+static void usbhid_keyboard_report(uint8_t report[8]) {
+    memset(report, 0, 8);
+    report[0] = usbhid.keyboard.modifiers;
+    if (usbhid.keyboard.count > 6) {
+        memset(report + 2, 0x01, 6); // ErrorRollOver
+    } else {
+        memcpy(report + 2, usbhid.keyboard.keys, usbhid.keyboard.count);
+    }
+}
+
+// must be called with the lock held
+static int usbhid_mouse_report(uint8_t report[7], bool consume) {
+    int dx = usbhid.mouse.dx < -32767 ? -32767 : usbhid.mouse.dx > 32767 ? 32767 : usbhid.mouse.dx;
+    int dy = usbhid.mouse.dy < -32767 ? -32767 : usbhid.mouse.dy > 32767 ? 32767 : usbhid.mouse.dy;
+    int wheel = usbhid.mouse.wheel < -127 ? -127 : usbhid.mouse.wheel > 127 ? 127 : usbhid.mouse.wheel;
+    int hwheel = usbhid.mouse.hwheel < -127 ? -127 : usbhid.mouse.hwheel > 127 ? 127 : usbhid.mouse.hwheel;
+    int len;
+
+    if (usbhid.protocol[1]) {
+        report[0] = usbhid.mouse.buttons;
+        report[1] = (uint16_t)dx & 0xFF;
+        report[2] = (uint16_t)dx >> 8;
+        report[3] = (uint16_t)dy & 0xFF;
+        report[4] = (uint16_t)dy >> 8;
+        report[5] = (int8_t)wheel;
+        report[6] = (int8_t)hwheel;
+        len = 7;
+    } else {
+        // the boot protocol only has 8-bit motion and no wheel
+        dx = dx < -127 ? -127 : dx > 127 ? 127 : dx;
+        dy = dy < -127 ? -127 : dy > 127 ? 127 : dy;
+        wheel = hwheel = 0;
+        report[0] = usbhid.mouse.buttons & 0x07;
+        report[1] = (int8_t)dx;
+        report[2] = (int8_t)dy;
+        len = 3;
+    }
+
+    // anything which didn't fit will be sent in the next report
+    if (consume) {
+        usbhid.mouse.dx -= dx;
+        usbhid.mouse.dy -= dy;
+        usbhid.mouse.wheel -= wheel;
+        usbhid.mouse.hwheel -= hwheel;
+        usbhid.mouse.last_buttons = usbhid.mouse.buttons;
+    }
+    return len;
+}
+
+// must be called with the lock held
+static void usbhid_send_interrupt(uint8_t ep, const uint8_t *report, int len) {
+    if (!usbhid.receiving[(ep & 0x0f) - 1]) {
+        return;
+    }
+    struct usb_redir_interrupt_packet_header h = {
+        .endpoint = ep,
+        .status = usb_redir_success,
+        .length = htole16(len),
+    };
+    usbhid_send(usb_redir_interrupt_packet, usbhid.next_id++, &h, sizeof(h), report, len);
+}
+
+void usbhid_key(int code, int value) {
+    if (code < 0 || code >= KEY_MAX || value == 2) {
+        return;
+    }
+    pthread_mutex_lock(&usbhid.lock);
+
+    if (linux_to_hid_button[code]) {
+        if (value) {
+            usbhid.mouse.buttons |= linux_to_hid_button[code];
+        } else {
+            usbhid.mouse.buttons &= ~linux_to_hid_button[code];
+        }
+        // sent with the next sync
+        pthread_mutex_unlock(&usbhid.lock);
+        return;
+    }
+
+    uint8_t usage = linux_to_hid[code];
+    if (!usage) {
+        pthread_mutex_unlock(&usbhid.lock);
+        return;
+    }
+
+    bool changed = false;
+    if (usage >= 0xE0 && usage <= 0xE7) {
+        uint8_t bit = 1 << (usage - 0xE0);
+        uint8_t modifiers = value ? (usbhid.keyboard.modifiers | bit) : (usbhid.keyboard.modifiers & ~bit);
+        changed = modifiers != usbhid.keyboard.modifiers;
+        usbhid.keyboard.modifiers = modifiers;
+    } else {
+        int i;
+        for (i = 0; i < usbhid.keyboard.count; i++) {
+            if (usbhid.keyboard.keys[i] == usage) {
+                break;
+            }
+        }
+        if (value && i == usbhid.keyboard.count && usbhid.keyboard.count < (int)sizeof(usbhid.keyboard.keys)) {
+            usbhid.keyboard.keys[usbhid.keyboard.count++] = usage;
+            changed = true;
+        }
+        if (!value && i != usbhid.keyboard.count) {
+            memmove(usbhid.keyboard.keys + i, usbhid.keyboard.keys + i + 1, usbhid.keyboard.count - i - 1);
+            usbhid.keyboard.count--;
+            changed = true;
+        }
+    }
+
+    // send keys immediately, like we do for spice
+    if (changed) {
+        uint8_t report[8];
+        usbhid_keyboard_report(report);
+        usbhid_send_interrupt(USBHID_EP_KEYBOARD, report, sizeof(report));
+    }
+
+    pthread_mutex_unlock(&usbhid.lock);
+}
+
+void usbhid_rel(int code, int value) {
+    pthread_mutex_lock(&usbhid.lock);
+    switch (code) {
+    case REL_X:
+        usbhid.mouse.dx += value;
+        break;
+    case REL_Y:
+        usbhid.mouse.dy += value;
+        break;
+    case REL_WHEEL:
+        usbhid.mouse.wheel += value;
+        break;
+    case REL_HWHEEL:
+        usbhid.mouse.hwheel += value;
+        break;
+    }
+    pthread_mutex_unlock(&usbhid.lock);
+}
+
+void usbhid_sync(void) {
+    pthread_mutex_lock(&usbhid.lock);
+    while (usbhid.mouse.dx || usbhid.mouse.dy || usbhid.mouse.wheel || usbhid.mouse.hwheel || usbhid.mouse.buttons != usbhid.mouse.last_buttons) {
+        uint8_t report[7];
+        int len = usbhid_mouse_report(report, true);
+        usbhid_send_interrupt(USBHID_EP_MOUSE, report, len);
+        if (!usbhid.protocol[1]) {
+            usbhid.mouse.wheel = usbhid.mouse.hwheel = 0;
+        }
+    }
+    pthread_mutex_unlock(&usbhid.lock);
+}
+
+// must be called with the lock held
+static void usbhid_release_all_locked(void) {
+    if (usbhid.keyboard.modifiers || usbhid.keyboard.count) {
+        uint8_t report[8] = {0};
+        usbhid.keyboard.modifiers = 0;
+        usbhid.keyboard.count = 0;
+        usbhid_send_interrupt(USBHID_EP_KEYBOARD, report, sizeof(report));
+    }
+    usbhid.mouse.dx = usbhid.mouse.dy = usbhid.mouse.wheel = usbhid.mouse.hwheel = 0;
+    usbhid.mouse.buttons = 0;
+    if (usbhid.mouse.last_buttons) {
+        uint8_t report[7];
+        int len = usbhid_mouse_report(report, true);
+        usbhid_send_interrupt(USBHID_EP_MOUSE, report, len);
+    }
+}
+
+void usbhid_release_all(void) {
+    pthread_mutex_lock(&usbhid.lock);
+    usbhid_release_all_locked();
+    pthread_mutex_unlock(&usbhid.lock);
+}
+
+bool usbhid_try_release_all(void) {
+    if (pthread_mutex_trylock(&usbhid.lock)) {
+        return false;
+    }
+    usbhid_release_all_locked();
+    pthread_mutex_unlock(&usbhid.lock);
+    return true;
+}
+
+// must be called with the lock held
+static void usbhid_send_device(void) {
+    struct usb_redir_interface_info_header ii = {
+        .interface_count = htole32(2),
+        .interface = {0, 1},
+        .interface_class = {0x03, 0x03},
+        .interface_subclass = {0x01, 0x01},
+        .interface_protocol = {0x01, 0x02},
+    };
+    usbhid_send(usb_redir_interface_info, 0, &ii, sizeof(ii), NULL, 0);
+
+    struct usb_redir_ep_info_header ep;
+    memset(ep.type, usb_redir_type_invalid, sizeof(ep.type));
+    memset(ep.interval, 0, sizeof(ep.interval));
+    memset(ep.interface, 0, sizeof(ep.interface));
+    memset(ep.max_packet_size, 0, sizeof(ep.max_packet_size));
+    ep.type[USBHID_EP_IDX(0x00)] = usb_redir_type_control;
+    ep.type[USBHID_EP_IDX(0x80)] = usb_redir_type_control;
+    ep.max_packet_size[USBHID_EP_IDX(0x00)] = htole16(64);
+    ep.max_packet_size[USBHID_EP_IDX(0x80)] = htole16(64);
+    ep.type[USBHID_EP_IDX(USBHID_EP_KEYBOARD)] = usb_redir_type_interrupt;
+    ep.interval[USBHID_EP_IDX(USBHID_EP_KEYBOARD)] = 1;
+    ep.interface[USBHID_EP_IDX(USBHID_EP_KEYBOARD)] = 0;
+    ep.max_packet_size[USBHID_EP_IDX(USBHID_EP_KEYBOARD)] = htole16(8);
+    ep.type[USBHID_EP_IDX(USBHID_EP_MOUSE)] = usb_redir_type_interrupt;
+    ep.interval[USBHID_EP_IDX(USBHID_EP_MOUSE)] = 1;
+    ep.interface[USBHID_EP_IDX(USBHID_EP_MOUSE)] = 1;
+    ep.max_packet_size[USBHID_EP_IDX(USBHID_EP_MOUSE)] = htole16(8);
+    usbhid_send(usb_redir_ep_info, 0, &ep,
+        usbhid.peer_ep_info_max_packet_size ? sizeof(ep) : offsetof(struct usb_redir_ep_info_header, max_packet_size),
+        NULL, 0);
+
+    struct usb_redir_device_connect_header dc = {
+        .speed = usb_redir_speed_full,
+        .device_class = 0,
+        .device_subclass = 0,
+        .device_protocol = 0,
+        .vendor_id = htole16(usbhid_device_desc[8] | usbhid_device_desc[9] << 8),
+        .product_id = htole16(usbhid_device_desc[10] | usbhid_device_desc[11] << 8),
+        .device_version_bcd = htole16(usbhid_device_desc[12] | usbhid_device_desc[13] << 8),
+    };
+    usbhid_send(usb_redir_device_connect, 0, &dc,
+        usbhid.peer_connect_device_version ? sizeof(dc) : offsetof(struct usb_redir_device_connect_header, device_version_bcd),
+        NULL, 0);
+}
+
+// must be called with the lock held
+static void usbhid_handle_control(uint32_t id, struct usb_redir_control_packet_header *h, const uint8_t *data, size_t data_len) {
+    uint16_t value = le16toh(h->value);
+    uint16_t index = le16toh(h->index);
+    uint16_t length = le16toh(h->length);
+    uint8_t buf[256];
+    int len = -1; // -1 stalls
+
+    switch (h->requesttype << 8 | h->request) {
+    case 0x8006: // GET_DESCRIPTOR (device)
+        switch (value >> 8) {
+        case 0x01:
+            memcpy(buf, usbhid_device_desc, (len = sizeof(usbhid_device_desc)));
+            break;
+        case 0x02:
+            memcpy(buf, usbhid_config_desc, (len = sizeof(usbhid_config_desc)));
+            break;
+        case 0x03:
+            if ((value & 0xFF) == 0) {
+                buf[0] = 4;
+                buf[1] = 0x03;
+                buf[2] = 0x09; // en-US
+                buf[3] = 0x04;
+                len = 4;
+            } else if ((value & 0xFF) < sizeof(usbhid_strings)/sizeof(*usbhid_strings) && usbhid_strings[value & 0xFF]) {
+                const char *s = usbhid_strings[value & 0xFF];
+                len = 2;
+                while (*s && len + 2 <= (int)sizeof(buf)) {
+                    buf[len++] = *s++;
+                    buf[len++] = 0;
+                }
+                buf[0] = len;
+                buf[1] = 0x03;
+            }
+            break;
+        }
+        break;
+    case 0x8106: // GET_DESCRIPTOR (interface)
+        if (index > 1) {
+            break;
+        }
+        switch (value >> 8) {
+        case 0x21:
+            memcpy(buf, usbhid_config_desc + 9 + index * 25 + 9, (len = 9));
+            break;
+        case 0x22:
+            if (index == 0) {
+                memcpy(buf, usbhid_keyboard_report_desc, (len = sizeof(usbhid_keyboard_report_desc)));
+            } else {
+                memcpy(buf, usbhid_mouse_report_desc, (len = sizeof(usbhid_mouse_report_desc)));
+            }
+            break;
+        }
+        break;
+    case 0x8000: // GET_STATUS (device)
+    case 0x8100: // GET_STATUS (interface)
+    case 0x8200: // GET_STATUS (endpoint)
+        buf[0] = buf[1] = 0;
+        len = 2;
+        break;
+    case 0x0001: // CLEAR_FEATURE (device)
+    case 0x0003: // SET_FEATURE (device)
+    case 0x0201: // CLEAR_FEATURE (endpoint)
+        len = 0;
+        break;
+    case 0x2109: // SET_REPORT (leds)
+        len = data_len;
+        break;
+    case 0x210A: // SET_IDLE
+        if (index <= 1) {
+            usbhid.idle[index] = value >> 8;
+            len = 0;
+        }
+        break;
+    case 0x210B: // SET_PROTOCOL
+        if (index <= 1) {
+            usbhid.protocol[index] = value & 1;
+            len = 0;
+        }
+        break;
+    case 0xA101: // GET_REPORT
+        if (index == 0) {
+            usbhid_keyboard_report(buf);
+            len = 8;
+        } else if (index == 1) {
+            len = usbhid_mouse_report(buf, false);
+        }
+        break;
+    case 0xA102: // GET_IDLE
+        if (index <= 1) {
+            buf[0] = usbhid.idle[index];
+            len = 1;
+        }
+        break;
+    case 0xA103: // GET_PROTOCOL
+        if (index <= 1) {
+            buf[0] = usbhid.protocol[index];
+            len = 1;
+        }
+        break;
+    }
+
+    if (len < 0) {
+        h->status = usb_redir_stall;
+        h->length = 0;
+        usbhid_send(usb_redir_control_packet, id, h, sizeof(*h), NULL, 0);
+    } else if (h->endpoint & 0x80) {
+        if (len > length) {
+            len = length;
+        }
+        h->status = usb_redir_success;
+        h->length = htole16(len);
+        usbhid_send(usb_redir_control_packet, id, h, sizeof(*h), buf, len);
+    } else {
+        h->status = usb_redir_success;
+        h->length = htole16(len);
+        usbhid_send(usb_redir_control_packet, id, h, sizeof(*h), NULL, 0);
+    }
+}
+
+// must be called with the lock held
+static void usbhid_handle(uint32_t type, uint32_t id, uint8_t *pkt, size_t len) {
+    switch (type) {
+    case usb_redir_hello: {
+        if (len < 64) {
+            break;
+        }
+        uint32_t caps = 0;
+        if (len >= 64 + sizeof(caps)) {
+            memcpy(&caps, pkt + 64, sizeof(caps));
+            caps = le32toh(caps);
+        }
+        usbhid.peer_connect_device_version = caps & (1 << usb_redir_cap_connect_device_version);
+        usbhid.peer_ep_info_max_packet_size = caps & (1 << usb_redir_cap_ep_info_max_packet_size);
+        printf("usbhid: connected to %.64s\n", (const char *)pkt);
+        usbhid_send_device();
+        break;
+    }
+    case usb_redir_reset:
+        usbhid.protocol[0] = usbhid.protocol[1] = 1;
+        usbhid.configuration = 0;
+        break;
+    case usb_redir_set_configuration:
+    case usb_redir_get_configuration: {
+        if (type == usb_redir_set_configuration && len >= 1) {
+            usbhid.configuration = pkt[0];
+        }
+        uint8_t st[2] = {usb_redir_success, usbhid.configuration};
+        usbhid_send(usb_redir_configuration_status, id, st, sizeof(st), NULL, 0);
+        break;
+    }
+    case usb_redir_set_alt_setting:
+    case usb_redir_get_alt_setting: {
+        // interface, alt
+        uint8_t st[3] = {usb_redir_success, len >= 1 ? pkt[0] : 0, 0};
+        if (type == usb_redir_set_alt_setting && len >= 2 && pkt[1] != 0) {
+            st[0] = usb_redir_inval;
+        }
+        usbhid_send(usb_redir_alt_setting_status, id, st, sizeof(st), NULL, 0);
+        break;
+    }
+    case usb_redir_start_interrupt_receiving:
+    case usb_redir_stop_interrupt_receiving: {
+        if (len < 1) {
+            break;
+        }
+        uint8_t st[2] = {usb_redir_success, pkt[0]};
+        if (pkt[0] == USBHID_EP_KEYBOARD || pkt[0] == USBHID_EP_MOUSE) {
+            usbhid.receiving[(pkt[0] & 0x0f) - 1] = type == usb_redir_start_interrupt_receiving;
+        } else {
+            st[0] = usb_redir_inval;
+        }
+        usbhid_send(usb_redir_interrupt_receiving_status, id, st, sizeof(st), NULL, 0);
+        break;
+    }
+    case usb_redir_control_packet: {
+        struct usb_redir_control_packet_header h;
+        if (len < sizeof(h)) {
+            break;
+        }
+        memcpy(&h, pkt, sizeof(h));
+        usbhid_handle_control(id, &h, pkt + sizeof(h), len - sizeof(h));
+        break;
+    }
+    default:
+        // everything else (filters, cancellations, acks) can be ignored
+        break;
+    }
+}
+
+static int usbhid_connect(void) {
+    char port[16];
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    }, *res, *ai;
+    int rc, fd = -1;
+
+    snprintf(port, sizeof(port), "%d", usbhid.opts.port);
+    if ((rc = getaddrinfo(usbhid.opts.host, port, &hints, &res))) {
+        fprintf(stderr, "usbhid: failed to resolve %s: %s\n", usbhid.opts.host, gai_strerror(rc));
+        return -1;
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol)) == -1) {
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd != -1) {
+        // reports are tiny and latency-sensitive
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+static bool usbhid_read_full(int fd, void *buf, size_t n) {
+    for (size_t off = 0; off < n;) {
+        ssize_t r = recv(fd, (uint8_t *)buf + off, n - off, 0);
+        if (r == -1 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return false;
+        }
+        off += r;
+    }
+    return true;
+}
+
+static void *usbhid_thread(void *data) {
+    prctl(PR_SET_NAME, "usbhid");
+
+    static uint8_t pkt[65536];
+    bool warned = false;
+
+    while (1) {
+        int fd = usbhid_connect();
+        if (fd == -1) {
+            if (!warned) {
+                fprintf(stderr, "usbhid: warning: failed to connect to %s:%d, will keep retrying\n", usbhid.opts.host, usbhid.opts.port);
+                warned = true;
+            }
+            sleep(1);
+            continue;
+        }
+        warned = false;
+
+        pthread_mutex_lock(&usbhid.lock);
+        usbhid.fd = fd;
+        usbhid.next_id = 0;
+        usbhid.configuration = 0;
+        usbhid.protocol[0] = usbhid.protocol[1] = 1;
+        usbhid.idle[0] = usbhid.idle[1] = 0;
+        usbhid.receiving[0] = usbhid.receiving[1] = false;
+
+        struct {
+            char version[64];
+            uint32_t caps;
+        } __attribute__((packed)) hello = {
+            .version = "spicy-kvm",
+            .caps = htole32(
+                (1 << usb_redir_cap_connect_device_version) |
+                (1 << usb_redir_cap_ep_info_max_packet_size)),
+        };
+        usbhid_send(usb_redir_hello, 0, &hello, sizeof(hello), NULL, 0);
+        pthread_mutex_unlock(&usbhid.lock);
+
+        struct usb_redir_header h;
+        while (usbhid_read_full(fd, &h, sizeof(h))) {
+            uint32_t len = le32toh(h.length);
+            if (len > sizeof(pkt)) {
+                fprintf(stderr, "usbhid: warning: packet too large (%u bytes)\n", len);
+                break;
+            }
+            if (!usbhid_read_full(fd, pkt, len)) {
+                break;
+            }
+            pthread_mutex_lock(&usbhid.lock);
+            usbhid_handle(le32toh(h.type), le32toh(h.id), pkt, len);
+            pthread_mutex_unlock(&usbhid.lock);
+        }
+
+        printf("usbhid: disconnected\n");
+        pthread_mutex_lock(&usbhid.lock);
+        close(usbhid.fd);
+        usbhid.fd = -1;
+        pthread_mutex_unlock(&usbhid.lock);
+        sleep(1);
+    }
+    return NULL;
+}
+
+bool usbhid_init(const struct usbhid_opts *opts) {
+    int rc;
+    pthread_t thread;
+    if (!opts || !opts->host || !opts->port) {
+        return false;
+    }
+    usbhid.opts = *opts;
+    if ((rc = pthread_create(&thread, NULL, usbhid_thread, NULL))) {
+        return false; // rc is errno
+    }
+    return true;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <stdbool.h>
+
+/*
+ * Presents a synthetic full-speed USB HID keyboard and mouse to the guest by
+ * acting as a usbredir host. QEMU should be configured with something like:
+ *
+ *   -chardev socket,id=usbredir0,host=0.0.0.0,port=4000,server=on,wait=off
+ *   -device usb-redir,chardev=usbredir0
+ *
+ * Both interfaces use 1 ms interrupt endpoints, and reports are sent as soon
+ * as the physical device reports a change.
+ */
+
+struct usbhid_opts {
+    const char *host;
+    int port;
+};
+
+bool usbhid_init(const struct usbhid_opts *opts);
+
+// evdev key or button state change (value 1 is down, 0 is up, 2 is ignored)
+void usbhid_key(int code, int value);
+
+// accumulate relative motion until the next usbhid_sync
+void usbhid_rel(int code, int value);
+
+// send the pending mouse report, if anything changed
+void usbhid_sync(void);
+
+// release all keys and buttons
+void usbhid_release_all(void);
+
+// like usbhid_release_all, but returns false instead of waiting if another
+// thread is currently sending
+bool usbhid_try_release_all(void);
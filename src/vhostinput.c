@@ -0,0 +1,883 @@
+/**
+ * Copyright © 2024 Patrick Gaskin
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+#define _GNU_SOURCE // for accept4
+#include <endian.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <linux/input.h>
+
+#include "lg_common/util.h"
+
+#include "vhostinput.h"
+
+// https://qemu-project.gitlab.io/qemu/interop/vhost-user.html
+
+enum {
+    VHOST_USER_GET_FEATURES = 1,
+    VHOST_USER_SET_FEATURES = 2,
+    VHOST_USER_SET_OWNER = 3,
+    VHOST_USER_RESET_OWNER = 4,
+    VHOST_USER_SET_MEM_TABLE = 5,
+    VHOST_USER_SET_VRING_NUM = 8,
+    VHOST_USER_SET_VRING_ADDR = 9,
+    VHOST_USER_SET_VRING_BASE = 10,
+    VHOST_USER_GET_VRING_BASE = 11,
+    VHOST_USER_SET_VRING_KICK = 12,
+    VHOST_USER_SET_VRING_CALL = 13,
+    VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+    VHOST_USER_GET_QUEUE_NUM = 17,
+    VHOST_USER_SET_VRING_ENABLE = 18,
+    VHOST_USER_GET_CONFIG = 24,
+    VHOST_USER_SET_CONFIG = 25,
+};
+
+#define VHOST_USER_VERSION 0x1
+#define VHOST_USER_REPLY_MASK 0x4
+
+#define VHOST_USER_VRING_IDX_MASK 0xff
+#define VHOST_USER_VRING_NOFD_MASK 0x100
+
+#define VIRTIO_F_VERSION_1 32
+#define VHOST_USER_F_PROTOCOL_FEATURES 30
+#define VHOST_USER_PROTOCOL_F_CONFIG 9
+
+#define VHOST_USER_MAX_RAM_SLOTS 8
+
+struct vhost_user_hdr {
+    uint32_t request;
+    uint32_t flags;
+    uint32_t size;
+} __attribute__((packed));
+
+struct vhost_user_vring_state {
+    uint32_t index;
+    uint32_t num;
+} __attribute__((packed));
+
+struct vhost_user_vring_addr {
+    uint32_t index;
+    uint32_t flags;
+    uint64_t desc_user_addr;
+    uint64_t used_user_addr;
+    uint64_t avail_user_addr;
+    uint64_t log_guest_addr;
+} __attribute__((packed));
+
+struct vhost_user_mem_region {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint64_t mmap_offset;
+} __attribute__((packed));
+
+struct vhost_user_mem {
+    uint32_t nregions;
+    uint32_t padding;
+    struct vhost_user_mem_region regions[VHOST_USER_MAX_RAM_SLOTS];
+} __attribute__((packed));
+
+struct vhost_user_config {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t flags;
+    uint8_t region[256];
+} __attribute__((packed));
+
+// https://docs.oasis-open.org/virtio/virtio/v1.2/virtio-v1.2.html (2.7, 5.8)
+
+struct vring_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct vring_avail {
+    uint16_t flags;
+    _Atomic uint16_t idx;
+    uint16_t ring[];
+};
+
+struct vring_used_elem {
+    uint32_t id;
+    uint32_t len;
+};
+
+struct vring_used {
+    uint16_t flags;
+    _Atomic uint16_t idx;
+    struct vring_used_elem ring[];
+};
+
+#define VRING_DESC_F_WRITE 2
+#define VRING_AVAIL_F_NO_INTERRUPT 1
+
+enum {
+    VIRTIO_INPUT_CFG_UNSET = 0x00,
+    VIRTIO_INPUT_CFG_ID_NAME = 0x01,
+    VIRTIO_INPUT_CFG_ID_SERIAL = 0x02,
+    VIRTIO_INPUT_CFG_ID_DEVIDS = 0x03,
+    VIRTIO_INPUT_CFG_PROP_BITS = 0x10,
+    VIRTIO_INPUT_CFG_EV_BITS = 0x11,
+    VIRTIO_INPUT_CFG_ABS_INFO = 0x12,
+};
+
+struct virtio_input_config {
+    uint8_t select;
+    uint8_t subsel;
+    uint8_t size;
+    uint8_t reserved[5];
+    union {
+        char string[128];
+        uint8_t bitmap[128];
+        struct {
+            uint16_t bustype;
+            uint16_t vendor;
+            uint16_t product;
+            uint16_t version;
+        } ids;
+    } u;
+} __attribute__((packed));
+
+struct virtio_input_event {
+    uint16_t type;
+    uint16_t code;
+    uint32_t value;
+} __attribute__((packed));
+
+#define VHOSTINPUT_QUEUE_EVENT 0
+#define VHOSTINPUT_QUEUE_STATUS 1
+#define VHOSTINPUT_QUEUES 2
+
+// events which arrive while the guest has no buffers posted
+#define VHOSTINPUT_PENDING 256
+
+struct vhostinput_vring {
+    uint32_t num;
+    uint16_t last_avail_idx;
+    uint16_t used_idx;
+    bool enabled;
+    int kick_fd;
+    int call_fd;
+    // as set by the front-end, so the rings can be found again if the memory table changes
+    bool addr_set;
+    uint64_t desc_uva;
+    uint64_t avail_uva;
+    uint64_t used_uva;
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+};
+
+static struct {
+    struct vhostinput_opts opts;
+    pthread_mutex_t lock;
+
+    int conn_fd;
+    uint64_t features;
+    uint64_t protocol_features;
+
+    struct {
+        uint64_t guest_phys_addr;
+        uint64_t size;
+        uint64_t userspace_addr;
+        void *mmap_addr;
+        uint64_t mmap_size;
+        uint64_t mmap_offset;
+    } regions[VHOST_USER_MAX_RAM_SLOTS];
+    uint32_t nregions;
+
+    struct vhostinput_vring vring[VHOSTINPUT_QUEUES];
+    struct virtio_input_config config;
+
+    struct virtio_input_event pending[VHOSTINPUT_PENDING];
+    int pending_count;
+    bool pending_syn;
+    bool warned_overflow;
+
+    uint8_t keys[KEY_CNT / 8];
+} vhostinput = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .conn_fd = -1,
+};
+
+static void *vhostinput_gpa_to_va(uint64_t gpa, uint64_t len) {
+    for (uint32_t i = 0; i < vhostinput.nregions; i++) {
+        if (gpa >= vhostinput.regions[i].guest_phys_addr && gpa + len <= vhostinput.regions[i].guest_phys_addr + vhostinput.regions[i].size) {
+            return (uint8_t *)vhostinput.regions[i].mmap_addr + vhostinput.regions[i].mmap_offset + (gpa - vhostinput.regions[i].guest_phys_addr);
+        }
+    }
+    return NULL;
+}
+
+static void *vhostinput_uva_to_va(uint64_t uva) {
+    for (uint32_t i = 0; i < vhostinput.nregions; i++) {
+        if (uva >= vhostinput.regions[i].userspace_addr && uva < vhostinput.regions[i].userspace_addr + vhostinput.regions[i].size) {
+            return (uint8_t *)vhostinput.regions[i].mmap_addr + vhostinput.regions[i].mmap_offset + (uva - vhostinput.regions[i].userspace_addr);
+        }
+    }
+    return NULL;
+}
+
+// must be called with the lock held
+static bool vhostinput_vring_translate(struct vhostinput_vring *vr) {
+    vr->desc = vhostinput_uva_to_va(vr->desc_uva);
+    vr->avail = vhostinput_uva_to_va(vr->avail_uva);
+    vr->used = vhostinput_uva_to_va(vr->used_uva);
+    if (!vr->desc || !vr->avail || !vr->used) {
+        vr->desc = NULL;
+        vr->avail = NULL;
+        vr->used = NULL;
+        return false;
+    }
+    return true;
+}
+
+static bool vhostinput_vring_ready(const struct vhostinput_vring *vr) {
+    return vr->enabled && vr->num && vr->desc && vr->avail && vr->used;
+}
+
+// must be called with the lock held
+static void vhostinput_vring_notify(struct vhostinput_vring *vr) {
+    if (vr->call_fd != -1 && !(le16toh(vr->avail->flags) & VRING_AVAIL_F_NO_INTERRUPT)) {
+        eventfd_write(vr->call_fd, 1);
+    }
+}
+
+// must be called with the lock held
+static void vhostinput_flush(void) {
+    struct vhostinput_vring *vr = &vhostinput.vring[VHOSTINPUT_QUEUE_EVENT];
+    if (!vhostinput_vring_ready(vr) || !vhostinput.pending_count) {
+        return;
+    }
+
+    uint16_t avail_idx = le16toh(atomic_load_explicit(&vr->avail->idx, memory_order_acquire));
+    uint16_t used_idx = vr->used_idx;
+    int n = 0;
+    while (n < vhostinput.pending_count && vr->last_avail_idx != avail_idx) {
+        uint16_t head = le16toh(vr->avail->ring[vr->last_avail_idx % vr->num]);
+        if (head >= vr->num) {
+            fprintf(stderr, "vhostinput: warning: invalid descriptor index %u\n", head);
+            break;
+        }
+
+        // the driver posts one device-writable buffer per event
+        struct vring_desc *d = &vr->desc[head];
+        struct virtio_input_event *dst = NULL;
+        if ((le16toh(d->flags) & VRING_DESC_F_WRITE) && le32toh(d->len) >= sizeof(*dst)) {
+            dst = vhostinput_gpa_to_va(le64toh(d->addr), sizeof(*dst));
+        }
+        if (dst) {
+            memcpy(dst, &vhostinput.pending[n++], sizeof(*dst));
+        }
+
+        struct vring_used_elem *e = &vr->used->ring[vr->used_idx % vr->num];
+        e->id = htole32(head);
+        e->len = htole32(dst ? sizeof(*dst) : 0);
+        vr->used_idx++;
+        vr->last_avail_idx++;
+    }
+
+    // invalid buffers are still returned to the driver, even if no event went into them
+    if (vr->used_idx != used_idx) {
+        atomic_store_explicit(&vr->used->idx, htole16(vr->used_idx), memory_order_release);
+        vhostinput_vring_notify(vr);
+    }
+
+    vhostinput.pending_count -= n;
+    memmove(vhostinput.pending, vhostinput.pending + n, vhostinput.pending_count * sizeof(*vhostinput.pending));
+}
+
+// must be called with the lock held
+static void vhostinput_drain_status(void) {
+    // we don't have any leds, so just give the buffers back
+    struct vhostinput_vring *vr = &vhostinput.vring[VHOSTINPUT_QUEUE_STATUS];
+    if (!vhostinput_vring_ready(vr)) {
+        return;
+    }
+    uint16_t avail_idx = le16toh(atomic_load_explicit(&vr->avail->idx, memory_order_acquire));
+    bool any = false;
+    while (vr->last_avail_idx != avail_idx) {
+        struct vring_used_elem *e = &vr->used->ring[vr->used_idx % vr->num];
+        e->id = htole32(le16toh(vr->avail->ring[vr->last_avail_idx % vr->num]));
+        e->len = 0;
+        vr->used_idx++;
+        vr->last_avail_idx++;
+        any = true;
+    }
+    if (any) {
+        atomic_store_explicit(&vr->used->idx, htole16(vr->used_idx), memory_order_release);
+        vhostinput_vring_notify(vr);
+    }
+}
+
+// must be called with the lock held
+static void vhostinput_queue(int type, int code, int value) {
+    if (vhostinput.pending_count == VHOSTINPUT_PENDING) {
+        // the guest isn't reading events, so there's no point in keeping old ones
+        if (!vhostinput.warned_overflow) {
+            fprintf(stderr, "vhostinput: warning: guest is not accepting events, dropping them\n");
+            vhostinput.warned_overflow = true;
+        }
+        return;
+    }
+    vhostinput.warned_overflow = false;
+    vhostinput.pending[vhostinput.pending_count++] = (struct virtio_input_event) {
+        .type = htole16(type),
+        .code = htole16(code),
+        .value = htole32(value),
+    };
+    vhostinput.pending_syn = type != EV_SYN;
+}
+
+void vhostinput_event(int type, int code, int value) {
+    if (type == EV_KEY && (code < 0 || code >= KEY_CNT || value == 2)) {
+        return;
+    }
+    pthread_mutex_lock(&vhostinput.lock);
+    if (type == EV_KEY) {
+        if (value) {
+            vhostinput.keys[code / 8] |= 1 << (code % 8);
+        } else {
+            vhostinput.keys[code / 8] &= ~(1 << (code % 8));
+        }
+    }
+    vhostinput_queue(type, code, value);
+    pthread_mutex_unlock(&vhostinput.lock);
+}
+
+void vhostinput_sync(void) {
+    pthread_mutex_lock(&vhostinput.lock);
+    if (vhostinput.pending_syn) {
+        vhostinput_queue(EV_SYN, SYN_REPORT, 0);
+        vhostinput_flush();
+    }
+    pthread_mutex_unlock(&vhostinput.lock);
+}
+
+// must be called with the lock held
+static void vhostinput_release_all_locked(void) {
+    for (int code = 0; code < KEY_CNT; code++) {
+        if (vhostinput.keys[code / 8] & (1 << (code % 8))) {
+            vhostinput_queue(EV_KEY, code, 0);
+        }
+    }
+    memset(vhostinput.keys, 0, sizeof(vhostinput.keys));
+    if (vhostinput.pending_syn) {
+        vhostinput_queue(EV_SYN, SYN_REPORT, 0);
+        vhostinput_flush();
+    }
+}
+
+void vhostinput_release_all(void) {
+    pthread_mutex_lock(&vhostinput.lock);
+    vhostinput_release_all_locked();
+    pthread_mutex_unlock(&vhostinput.lock);
+}
+
+bool vhostinput_try_release_all(void) {
+    if (pthread_mutex_trylock(&vhostinput.lock)) {
+        return false;
+    }
+    vhostinput_release_all_locked();
+    pthread_mutex_unlock(&vhostinput.lock);
+    return true;
+}
+
+static void vhostinput_config_update(void) {
+    struct virtio_input_config *c = &vhostinput.config;
+    memset(&c->u, 0, sizeof(c->u));
+    c->size = 0;
+
+    switch (c->select) {
+    case VIRTIO_INPUT_CFG_ID_NAME:
+        c->size = snprintf(c->u.string, sizeof(c->u.string), "spicy-kvm");
+        break;
+    case VIRTIO_INPUT_CFG_ID_SERIAL:
+        c->size = snprintf(c->u.string, sizeof(c->u.string), "spicy-kvm");
+        break;
+    case VIRTIO_INPUT_CFG_ID_DEVIDS:
+        c->u.ids.bustype = htole16(BUS_VIRTUAL);
+        c->u.ids.vendor = htole16(0x0627); // same as qemu's virtio input devices
+        c->u.ids.product = htole16(0x0001);
+        c->u.ids.version = htole16(0x0001);
+        c->size = sizeof(c->u.ids);
+        break;
+    case VIRTIO_INPUT_CFG_EV_BITS:
+        switch (c->subsel) {
+        case EV_KEY:
+            for (int code = KEY_ESC; code <= KEY_MICMUTE; code++) {
+                c->u.bitmap[code / 8] |= 1 << (code % 8);
+            }
+            for (int code = BTN_LEFT; code <= BTN_TASK; code++) {
+                c->u.bitmap[code / 8] |= 1 << (code % 8);
+            }
+            c->size = BTN_TASK / 8 + 1;
+            break;
+        case EV_REL:
+            c->u.bitmap[REL_X / 8] |= 1 << (REL_X % 8);
+            c->u.bitmap[REL_Y / 8] |= 1 << (REL_Y % 8);
+            c->u.bitmap[REL_HWHEEL / 8] |= 1 << (REL_HWHEEL % 8);
+            c->u.bitmap[REL_WHEEL / 8] |= 1 << (REL_WHEEL % 8);
+            c->size = REL_WHEEL / 8 + 1;
+            break;
+        }
+        break;
+    }
+}
+
+static void vhostinput_reset(void) {
+    for (int i = 0; i < VHOSTINPUT_QUEUES; i++) {
+        struct vhostinput_vring *vr = &vhostinput.vring[i];
+        if (vr->kick_fd != -1) {
+            close(vr->kick_fd);
+        }
+        if (vr->call_fd != -1) {
+            close(vr->call_fd);
+        }
+        *vr = (struct vhostinput_vring) {
+            .kick_fd = -1,
+            .call_fd = -1,
+        };
+    }
+    for (uint32_t i = 0; i < vhostinput.nregions; i++) {
+        munmap(vhostinput.regions[i].mmap_addr, vhostinput.regions[i].mmap_size);
+    }
+    vhostinput.nregions = 0;
+    vhostinput.features = 0;
+    vhostinput.protocol_features = 0;
+    vhostinput.pending_count = 0;
+    vhostinput.pending_syn = false;
+    memset(&vhostinput.config, 0, sizeof(vhostinput.config));
+}
+
+static bool vhostinput_reply(const struct vhost_user_hdr *req, const void *payload, uint32_t size) {
+    struct {
+        struct vhost_user_hdr hdr;
+        uint8_t payload[sizeof(struct vhost_user_config)];
+    } __attribute__((packed)) msg = {
+        .hdr = {
+            .request = req->request,
+            .flags = VHOST_USER_VERSION | VHOST_USER_REPLY_MASK,
+            .size = size,
+        },
+    };
+    memcpy(msg.payload, payload, size);
+    size_t n = sizeof(msg.hdr) + size;
+    return send(vhostinput.conn_fd, &msg, n, MSG_NOSIGNAL) == (ssize_t)n;
+}
+
+// must be called with the lock held
+static bool vhostinput_handle(struct vhost_user_hdr *hdr, uint8_t *payload, int *fds, int nfds) {
+    uint64_t u64 = 0;
+    if (hdr->size >= sizeof(u64)) {
+        memcpy(&u64, payload, sizeof(u64));
+    }
+
+    switch (hdr->request) {
+    case VHOST_USER_GET_FEATURES:
+        u64 = (1ULL << VIRTIO_F_VERSION_1) | (1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
+        return vhostinput_reply(hdr, &u64, sizeof(u64));
+
+    case VHOST_USER_SET_FEATURES:
+        vhostinput.features = u64;
+        // without protocol features, rings are enabled as soon as they start
+        if (!(u64 & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES))) {
+            for (int i = 0; i < VHOSTINPUT_QUEUES; i++) {
+                vhostinput.vring[i].enabled = true;
+            }
+        }
+        return true;
+
+    case VHOST_USER_GET_PROTOCOL_FEATURES:
+        u64 = 1ULL << VHOST_USER_PROTOCOL_F_CONFIG;
+        return vhostinput_reply(hdr, &u64, sizeof(u64));
+
+    case VHOST_USER_SET_PROTOCOL_FEATURES:
+        vhostinput.protocol_features = u64;
+        return true;
+
+    case VHOST_USER_GET_QUEUE_NUM:
+        u64 = VHOSTINPUT_QUEUES;
+        return vhostinput_reply(hdr, &u64, sizeof(u64));
+
+    case VHOST_USER_SET_OWNER:
+    case VHOST_USER_RESET_OWNER:
+        return true;
+
+    case VHOST_USER_SET_MEM_TABLE: {
+        struct vhost_user_mem mem;
+        if (hdr->size < offsetof(struct vhost_user_mem, regions)) {
+            return false;
+        }
+        memcpy(&mem, payload, min(hdr->size, sizeof(mem)));
+        if (mem.nregions > VHOST_USER_MAX_RAM_SLOTS || mem.nregions != (uint32_t)nfds) {
+            fprintf(stderr, "vhostinput: invalid memory table\n");
+            return false;
+        }
+        // map the new table completely before replacing the old one
+        void *addrs[VHOST_USER_MAX_RAM_SLOTS];
+        uint64_t sizes[VHOST_USER_MAX_RAM_SLOTS];
+        for (uint32_t i = 0; i < mem.nregions; i++) {
+            sizes[i] = mem.regions[i].memory_size + mem.regions[i].mmap_offset;
+            addrs[i] = mmap(NULL, sizes[i], PROT_READ | PROT_WRITE, MAP_SHARED, fds[i], 0);
+            if (addrs[i] == MAP_FAILED) {
+                fprintf(stderr, "vhostinput: failed to map guest memory: %s\n", strerror(errno));
+                while (i--) {
+                    munmap(addrs[i], sizes[i]);
+                }
+                return false;
+            }
+        }
+        for (uint32_t i = 0; i < vhostinput.nregions; i++) {
+            munmap(vhostinput.regions[i].mmap_addr, vhostinput.regions[i].mmap_size);
+        }
+        for (uint32_t i = 0; i < mem.nregions; i++) {
+            vhostinput.regions[i].guest_phys_addr = mem.regions[i].guest_phys_addr;
+            vhostinput.regions[i].size = mem.regions[i].memory_size;
+            vhostinput.regions[i].userspace_addr = mem.regions[i].userspace_addr;
+            vhostinput.regions[i].mmap_addr = addrs[i];
+            vhostinput.regions[i].mmap_size = sizes[i];
+            vhostinput.regions[i].mmap_offset = mem.regions[i].mmap_offset;
+        }
+        vhostinput.nregions = mem.nregions;
+
+        // the front-end doesn't resend the ring addresses after hotplug, and the old pointers are gone
+        for (int i = 0; i < VHOSTINPUT_QUEUES; i++) {
+            struct vhostinput_vring *vr = &vhostinput.vring[i];
+            if (vr->addr_set && !vhostinput_vring_translate(vr)) {
+                fprintf(stderr, "vhostinput: warning: vring %d is no longer in guest memory\n", i);
+            }
+        }
+        return true;
+    }
+
+    case VHOST_USER_SET_VRING_NUM:
+    case VHOST_USER_SET_VRING_BASE:
+    case VHOST_USER_GET_VRING_BASE:
+    case VHOST_USER_SET_VRING_ENABLE: {
+        struct vhost_user_vring_state st;
+        if (hdr->size < sizeof(st)) {
+            return false;
+        }
+        memcpy(&st, payload, sizeof(st));
+        if (st.index >= VHOSTINPUT_QUEUES) {
+            return false;
+        }
+        struct vhostinput_vring *vr = &vhostinput.vring[st.index];
+        switch (hdr->request) {
+        case VHOST_USER_SET_VRING_NUM:
+            vr->num = st.num;
+            return true;
+        case VHOST_USER_SET_VRING_BASE:
+            vr->last_avail_idx = vr->used_idx = st.num;
+            return true;
+        case VHOST_USER_GET_VRING_BASE:
+            // this also stops the ring
+            st.num = vr->last_avail_idx;
+            vr->addr_set = false;
+            vr->desc = NULL;
+            vr->avail = NULL;
+            vr->used = NULL;
+            if (vr->kick_fd != -1) {
+                close(vr->kick_fd);
+                vr->kick_fd = -1;
+            }
+            return vhostinput_reply(hdr, &st, sizeof(st));
+        case VHOST_USER_SET_VRING_ENABLE:
+            vr->enabled = st.num;
+            return true;
+        }
+        return false;
+    }
+
+    case VHOST_USER_SET_VRING_ADDR: {
+        struct vhost_user_vring_addr a;
+        if (hdr->size < sizeof(a)) {
+            return false;
+        }
+        memcpy(&a, payload, sizeof(a));
+        if (a.index >= VHOSTINPUT_QUEUES) {
+            return false;
+        }
+        struct vhostinput_vring *vr = &vhostinput.vring[a.index];
+        vr->desc_uva = a.desc_user_addr;
+        vr->avail_uva = a.avail_user_addr;
+        vr->used_uva = a.used_user_addr;
+        vr->addr_set = vhostinput_vring_translate(vr);
+        if (!vr->addr_set) {
+            fprintf(stderr, "vhostinput: invalid vring address\n");
+            return false;
+        }
+        // pick up where the driver actually is
+        vr->used_idx = le16toh(atomic_load(&vr->used->idx));
+        return true;
+    }
+
+    case VHOST_USER_SET_VRING_KICK:
+    case VHOST_USER_SET_VRING_CALL:
+    case VHOST_USER_SET_VRING_ERR: {
+        uint32_t index = u64 & VHOST_USER_VRING_IDX_MASK;
+        int fd = (u64 & VHOST_USER_VRING_NOFD_MASK) || nfds < 1 ? -1 : fds[0];
+        if (index >= VHOSTINPUT_QUEUES) {
+            return false;
+        }
+        struct vhostinput_vring *vr = &vhostinput.vring[index];
+        if (hdr->request == VHOST_USER_SET_VRING_KICK) {
+            if (vr->kick_fd != -1) {
+                close(vr->kick_fd);
+            }
+            vr->kick_fd = fd;
+        } else if (hdr->request == VHOST_USER_SET_VRING_CALL) {
+            if (vr->call_fd != -1) {
+                close(vr->call_fd);
+            }
+            vr->call_fd = fd;
+        } else if (fd != -1) {
+            close(fd);
+        }
+        return true;
+    }
+
+    case VHOST_USER_GET_CONFIG:
+    case VHOST_USER_SET_CONFIG: {
+        struct vhost_user_config cfg = {0};
+        if (hdr->size < offsetof(struct vhost_user_config, region)) {
+            return false;
+        }
+        memcpy(&cfg, payload, min(hdr->size, sizeof(cfg)));
+        if (cfg.offset > sizeof(vhostinput.config) || cfg.size > sizeof(cfg.region)) {
+            return false;
+        }
+        uint32_t n = min(cfg.size, (uint32_t)sizeof(vhostinput.config) - cfg.offset);
+        if (hdr->request == VHOST_USER_SET_CONFIG) {
+            // the driver selects what it wants to read by writing select and subsel
+            memcpy((uint8_t *)&vhostinput.config + cfg.offset, cfg.region, n);
+            vhostinput_config_update();
+            return true;
+        }
+        memset(cfg.region, 0, sizeof(cfg.region));
+        memcpy(cfg.region, (uint8_t *)&vhostinput.config + cfg.offset, n);
+        return vhostinput_reply(hdr, &cfg, offsetof(struct vhost_user_config, region) + cfg.size);
+    }
+
+    default:
+        fprintf(stderr, "vhostinput: warning: ignoring unsupported request %u\n", hdr->request);
+        for (int i = 0; i < nfds; i++) {
+            close(fds[i]);
+        }
+        return true;
+    }
+}
+
+static bool vhostinput_read_full(int fd, void *buf, size_t n) {
+    for (size_t off = 0; off < n;) {
+        ssize_t r = recv(fd, (uint8_t *)buf + off, n - off, 0);
+        if (r == -1 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return false;
+        }
+        off += r;
+    }
+    return true;
+}
+
+static bool vhostinput_recv(void) {
+    struct vhost_user_hdr hdr;
+    uint8_t payload[4096];
+    int fds[VHOST_USER_MAX_RAM_SLOTS];
+    int nfds = 0;
+
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {
+        .iov_base = &hdr,
+        .iov_len = sizeof(hdr),
+    };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+
+    ssize_t r;
+    do {
+        r = recvmsg(vhostinput.conn_fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (r == -1 && errno == EINTR);
+    if (r <= 0) {
+        return false;
+    }
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(c), nfds * sizeof(int));
+        }
+    }
+    if (r < (ssize_t)sizeof(hdr) && !vhostinput_read_full(vhostinput.conn_fd, (uint8_t *)&hdr + r, sizeof(hdr) - r)) {
+        goto err;
+    }
+    if (hdr.size > sizeof(payload) || !vhostinput_read_full(vhostinput.conn_fd, payload, hdr.size)) {
+        goto err;
+    }
+
+    pthread_mutex_lock(&vhostinput.lock);
+    bool ok = vhostinput_handle(&hdr, payload, fds, nfds);
+    pthread_mutex_unlock(&vhostinput.lock);
+
+    // the memory table fds are only needed to map the regions
+    if (hdr.request == VHOST_USER_SET_MEM_TABLE) {
+        for (int i = 0; i < nfds; i++) {
+            close(fds[i]);
+        }
+    }
+    return ok;
+
+err:
+    for (int i = 0; i < nfds; i++) {
+        close(fds[i]);
+    }
+    return false;
+}
+
+static void *vhostinput_thread(void *data) {
+    int listen_fd = (int)(intptr_t)data;
+    prctl(PR_SET_NAME, "vhostinput");
+
+    while (1) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            fprintf(stderr, "vhostinput: failed to accept connection: %s\n", strerror(errno));
+            return NULL;
+        }
+        printf("vhostinput: front-end connected\n");
+
+        pthread_mutex_lock(&vhostinput.lock);
+        vhostinput_reset();
+        vhostinput.conn_fd = fd;
+        pthread_mutex_unlock(&vhostinput.lock);
+
+        while (1) {
+            struct pollfd pfd[1 + VHOSTINPUT_QUEUES] = {
+                {.fd = fd, .events = POLLIN},
+            };
+            pthread_mutex_lock(&vhostinput.lock);
+            for (int i = 0; i < VHOSTINPUT_QUEUES; i++) {
+                pfd[1 + i].fd = vhostinput.vring[i].kick_fd;
+                pfd[1 + i].events = POLLIN;
+            }
+            pthread_mutex_unlock(&vhostinput.lock);
+
+            if (poll(pfd, 1 + VHOSTINPUT_QUEUES, -1) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            if (pfd[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                break;
+            }
+            if (pfd[0].revents & POLLIN) {
+                if (!vhostinput_recv()) {
+                    break;
+                }
+                // kick fds may have changed
+                continue;
+            }
+
+            pthread_mutex_lock(&vhostinput.lock);
+            for (int i = 0; i < VHOSTINPUT_QUEUES; i++) {
+                if (pfd[1 + i].revents & POLLIN) {
+                    eventfd_t v;
+                    eventfd_read(vhostinput.vring[i].kick_fd, &v);
+                }
+            }
+            // new buffers may have been posted
+            vhostinput_flush();
+            vhostinput_drain_status();
+            pthread_mutex_unlock(&vhostinput.lock);
+        }
+
+        printf("vhostinput: front-end disconnected\n");
+        pthread_mutex_lock(&vhostinput.lock);
+        vhostinput_reset();
+        close(vhostinput.conn_fd);
+        vhostinput.conn_fd = -1;
+        pthread_mutex_unlock(&vhostinput.lock);
+    }
+    return NULL;
+}
+
+bool vhostinput_init(const struct vhostinput_opts *opts) {
+    int rc;
+    pthread_t thread;
+    if (!opts || !opts->path) {
+        return false;
+    }
+    vhostinput.opts = *opts;
+    for (int i = 0; i < VHOSTINPUT_QUEUES; i++) {
+        vhostinput.vring[i].kick_fd = -1;
+        vhostinput.vring[i].call_fd = -1;
+    }
+
+    struct sockaddr_un addr = {
+        .sun_family = AF_UNIX,
+    };
+    if (strlen(opts->path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "vhostinput: socket path too long\n");
+        return false;
+    }
+    strcpy(addr.sun_path, opts->path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return false;
+    }
+    unlink(opts->path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 1) == -1) {
+        fprintf(stderr, "vhostinput: failed to listen on %s: %s\n", opts->path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    printf("vhostinput: listening on %s\n", opts->path);
+
+    if ((rc = pthread_create(&thread, NULL, vhostinput_thread, (void *)(intptr_t)fd))) {
+        close(fd);
+        return false; // rc is errno
+    }
+    return true;
+}
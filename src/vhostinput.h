@@ -0,0 +1,32 @@
+#pragma once
+#include <stdbool.h>
+
+/*
+ * Acts as a vhost-user-input backend, writing events straight into the
+ * guest's virtio-input event queue. This only works for VMs on the same host,
+ * which should be configured with something like:
+ *
+ *   -chardev socket,id=vuinput,path=/tmp/spicy-kvm-input.sock,reconnect=1
+ *   -device vhost-user-input-pci,chardev=vuinput
+ *
+ * A single combined keyboard and relative pointer is presented to the guest.
+ */
+
+struct vhostinput_opts {
+    const char *path;
+};
+
+bool vhostinput_init(const struct vhostinput_opts *opts);
+
+// queue an evdev event (EV_KEY autorepeats are ignored since the guest does its own)
+void vhostinput_event(int type, int code, int value);
+
+// queue a SYN_REPORT if anything is pending, and notify the guest
+void vhostinput_sync(void);
+
+// release all keys and buttons
+void vhostinput_release_all(void);
+
+// like vhostinput_release_all, but returns false instead of waiting if another
+// thread is currently writing to the queue
+bool vhostinput_try_release_all(void);
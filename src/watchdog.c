@@ -0,0 +1,275 @@
+/**
+ * Copyright © 2024 Patrick Gaskin
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+#include <execinfo.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "watchdog.h"
+
+#define WATCHDOG_SIGNAL SIGUSR2
+
+struct watchdog_thread {
+    atomic_int used;     // 0 = free, 1 = being set up, 2 = registered
+    atomic_uint gen;     // incremented each time the slot is registered
+    char name[32];
+    pid_t tid;
+    int64_t threshold_ns;
+    void (*stall_cb)(const char *name);
+    _Atomic int64_t busy_since; // 0 when idle
+
+    // only touched by the watchdog thread
+    unsigned seen_gen;
+    int64_t stalled_since;
+};
+
+static struct {
+    struct watchdog_opts opts;
+    bool running;
+    atomic_bool stop;
+    pthread_t thread;
+    pthread_key_t key; // slot + 1 registered by the current thread
+    struct watchdog_thread threads[WATCHDOG_MAX_THREADS];
+} watchdog = {
+    .opts = {
+        .enable = false,
+        .interval_ms = 100,
+        .backtrace = true,
+    },
+};
+
+static int64_t watchdog_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void watchdog_write(const char *s) {
+    ssize_t n = write(STDERR_FILENO, s, strlen(s));
+    (void)n;
+}
+
+static void watchdog_backtrace_handler(int sig) {
+    void *frames[48];
+    int n = backtrace(frames, sizeof(frames) / sizeof(*frames));
+    watchdog_write("watchdog: --- backtrace ---\n");
+    backtrace_symbols_fd(frames, n, STDERR_FILENO);
+    watchdog_write("watchdog: ---\n");
+}
+
+// reads a small file from the thread's procfs directory into buf
+static bool watchdog_read_task(pid_t tid, const char *file, char *buf, size_t n) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/%s", tid, file);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    ssize_t r = read(fd, buf, n - 1);
+    close(fd);
+    if (r <= 0) {
+        return false;
+    }
+    buf[r] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+    return true;
+}
+
+static void watchdog_dump(struct watchdog_thread *t, unsigned gen) {
+    char wchan[64], sc[128];
+    if (!watchdog_read_task(t->tid, "wchan", wchan, sizeof(wchan))) {
+        snprintf(wchan, sizeof(wchan), "?");
+    }
+    if (!watchdog_read_task(t->tid, "syscall", sc, sizeof(sc))) {
+        snprintf(sc, sizeof(sc), "?");
+    }
+    fprintf(stderr, "watchdog: thread %s (tid %d) wchan=%s syscall=%s\n", t->name, t->tid, wchan, sc);
+
+    // the handler runs on the stalled thread itself, so this only works if
+    // it's spinning or in an interruptible wait
+    if (watchdog.opts.backtrace) {
+        // the thread may have exited since it was checked, so signal it by tid
+        // (which just fails if it's gone) rather than by pthread_t
+        if (atomic_load_explicit(&t->used, memory_order_acquire) == 2 && atomic_load(&t->gen) == gen) {
+            syscall(SYS_tgkill, getpid(), t->tid, WATCHDOG_SIGNAL);
+        }
+    }
+}
+
+static void watchdog_check(int64_t now) {
+    for (int i = 0; i < WATCHDOG_MAX_THREADS; i++) {
+        struct watchdog_thread *t = &watchdog.threads[i];
+        if (atomic_load_explicit(&t->used, memory_order_acquire) != 2) {
+            t->stalled_since = 0;
+            continue;
+        }
+
+        // a reused slot starts over, whatever its previous owner was doing
+        unsigned gen = atomic_load(&t->gen);
+        if (gen != t->seen_gen) {
+            t->seen_gen = gen;
+            t->stalled_since = 0;
+        }
+
+        int64_t busy_since = atomic_load_explicit(&t->busy_since, memory_order_relaxed);
+        if (!busy_since || busy_since != t->stalled_since) {
+            if (t->stalled_since) {
+                fprintf(stderr, "watchdog: thread %s recovered after %.0f ms\n", t->name, (now - t->stalled_since) / 1.0e6);
+                t->stalled_since = 0;
+            }
+        }
+        if (!busy_since || t->stalled_since || now - busy_since < t->threshold_ns) {
+            continue;
+        }
+
+        // only report each stall once
+        t->stalled_since = busy_since;
+        fprintf(stderr, "watchdog: warning: thread %s stalled for %.0f ms\n", t->name, (now - busy_since) / 1.0e6);
+        watchdog_dump(t, gen);
+        if (t->stall_cb) {
+            t->stall_cb(t->name);
+        }
+    }
+}
+
+static void *watchdog_main(void *data) {
+    prctl(PR_SET_NAME, "watchdog");
+
+    // this only needs to notice stalls on the order of a second, so stay out
+    // of the way of everything else
+    setpriority(PRIO_PROCESS, 0, 10);
+
+    const struct timespec ts = {
+        .tv_sec = watchdog.opts.interval_ms / 1000,
+        .tv_nsec = (watchdog.opts.interval_ms % 1000) * 1000000L,
+    };
+    while (!atomic_load(&watchdog.stop)) {
+        watchdog_check(watchdog_now());
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+static void watchdog_thread_exit(void *data) {
+    watchdog_unregister((int)(intptr_t)data - 1);
+}
+
+bool watchdog_init(const struct watchdog_opts *opts) {
+    int rc;
+    if (opts) {
+        watchdog.opts = *opts;
+    }
+    if (!watchdog.opts.enable) {
+        return true;
+    }
+    if (watchdog.opts.interval_ms <= 0) {
+        watchdog.opts.interval_ms = 100;
+    }
+    if (watchdog.opts.backtrace) {
+        // backtrace lazily loads libgcc, which isn't safe in a signal handler
+        void *frame;
+        backtrace(&frame, 1);
+
+        struct sigaction sa = {
+            .sa_handler = watchdog_backtrace_handler,
+            .sa_flags = SA_RESTART,
+        };
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(WATCHDOG_SIGNAL, &sa, NULL) == -1) {
+            fprintf(stderr, "watchdog: warning: failed to install backtrace handler\n");
+            watchdog.opts.backtrace = false;
+        }
+    }
+    // threads which exit without unregistering are cleaned up by the key's destructor
+    if ((rc = pthread_key_create(&watchdog.key, watchdog_thread_exit))) {
+        return false; // rc is errno
+    }
+    if ((rc = pthread_create(&watchdog.thread, NULL, watchdog_main, NULL))) {
+        pthread_key_delete(watchdog.key);
+        return false; // rc is errno
+    }
+    watchdog.running = true;
+    return true;
+}
+
+void watchdog_free(void) {
+    if (!watchdog.running) {
+        return;
+    }
+    atomic_store(&watchdog.stop, true);
+    pthread_join(watchdog.thread, NULL);
+    watchdog.running = false;
+}
+
+int watchdog_register(const char *name, int threshold_ms, void (*stall_cb)(const char *name)) {
+    if (!watchdog.opts.enable) {
+        return -1;
+    }
+    for (int i = 0; i < WATCHDOG_MAX_THREADS; i++) {
+        struct watchdog_thread *t = &watchdog.threads[i];
+        int expected = 0;
+        if (!atomic_compare_exchange_strong(&t->used, &expected, 1)) {
+            continue;
+        }
+        snprintf(t->name, sizeof(t->name), "%s", name);
+        t->tid = syscall(SYS_gettid);
+        t->threshold_ns = threshold_ms * 1000000LL;
+        t->stall_cb = stall_cb;
+        atomic_store_explicit(&t->busy_since, 0, memory_order_relaxed);
+        atomic_fetch_add(&t->gen, 1);
+        atomic_store_explicit(&t->used, 2, memory_order_release);
+        pthread_setspecific(watchdog.key, (void *)(intptr_t)(i + 1));
+        return i;
+    }
+    fprintf(stderr, "watchdog: warning: too many threads, not watching %s\n", name);
+    return -1;
+}
+
+void watchdog_unregister(int wd) {
+    if (wd < 0) {
+        return;
+    }
+    struct watchdog_thread *t = &watchdog.threads[wd];
+    if (t->tid == syscall(SYS_gettid)) {
+        pthread_setspecific(watchdog.key, NULL);
+    }
+    atomic_store_explicit(&t->used, 0, memory_order_release);
+}
+
+void watchdog_busy(int wd) {
+    if (wd < 0) {
+        return;
+    }
+    atomic_store_explicit(&watchdog.threads[wd].busy_since, watchdog_now(), memory_order_relaxed);
+}
+
+void watchdog_idle(int wd) {
+    if (wd < 0) {
+        return;
+    }
+    atomic_store_explicit(&watchdog.threads[wd].busy_since, 0, memory_order_relaxed);
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <stdbool.h>
+
+/*
+ * Stall detection for long-lived threads. Each thread registers itself, then
+ * marks itself busy while it is doing work, and idle before it blocks waiting
+ * for something external (an input event, a udev event, the next PipeWire
+ * cycle). If a thread stays busy for longer than its threshold, the watchdog
+ * dumps where it is stuck and calls its stall callback. Busy/idle only touch
+ * an atomic, so they are safe to call from realtime threads.
+ */
+
+#define WATCHDOG_MAX_THREADS 80
+
+struct watchdog_opts {
+    bool enable;
+    int interval_ms; // how often to check for stalls
+    bool backtrace;  // interrupt stalled threads to dump a backtrace
+};
+
+bool watchdog_init(const struct watchdog_opts *opts);
+void watchdog_free(void);
+
+// registers the calling thread, returning -1 if the watchdog isn't enabled or
+// there are no free slots (the other functions ignore negative handles); if the
+// thread exits without unregistering, its last registration is released then
+int watchdog_register(const char *name, int threshold_ms, void (*stall_cb)(const char *name));
+void watchdog_unregister(int wd);
+
+void watchdog_busy(int wd);
+void watchdog_idle(int wd);